@@ -1,12 +1,17 @@
 #pragma once
 
+#include <cstdlib>
 #include <iostream>
 
 #define STRINGIFY_(x) #x
 #define STRINGIFY(x) STRINGIFY_(x)
 
+// The environment is only read the first time each call site is reached
 #define LOG_CHANNEL_ENABLED(__channel) \
-    std::getenv(STRINGIFY(LOG_##__channel))
+    ([] { \
+        static const bool enabled = std::getenv(STRINGIFY(LOG_##__channel)); \
+        return enabled; \
+    }())
 
 #define LOG(__channel, ...) \
     do { \
@@ -23,12 +23,19 @@ void LexicalDeclaration::generate(BytecodeGenerator& generator, Register result)
 void FunctionDeclaration::generateImpl(BytecodeGenerator& generator, Register result)
 {
     for (unsigned i = 0; i < parameters.size(); i++)
-        generator.setLocal(*parameters[i]->name, Register::forParameter(i));
+        generator.setParameter(parameters[i]->name->name, i);
     body->generate(generator, result);
 }
 
+// The body is generated here rather than when it's type checked, so that it can
+// address the variables of the enclosing run code that it captures
 void FunctionDeclaration::generate(BytecodeGenerator& generator, Register result)
 {
+    generator.declareLocal(name->name);
+    BytecodeGenerator& functionGenerator = generator.functionGenerator(functionIndex);
+    Register functionResult = functionGenerator.newLocal();
+    generateImpl(functionGenerator, functionResult);
+    functionGenerator.finalize(functionResult, true);
     generator.newFunction(result, functionIndex);
     generator.setLocal(name->name, result);
 }
@@ -45,6 +52,7 @@ void EmptyStatement::generate(BytecodeGenerator&, Register)
 
 void BlockStatement::generate(BytecodeGenerator& generator, Register result)
 {
+    BytecodeGenerator::LexicalScope scope(generator);
     for (const auto& decl : declarations)
         decl->generate(generator, result);
     if (!declarations.size())
@@ -179,11 +187,15 @@ void CallExpression::generate(BytecodeGenerator& generator, Register dst)
 {
     Register calleeReg = generator.newLocal();
     callee->generate(generator, calleeReg);
-    std::vector<Register> args;
-    for (size_t i = 0; i < arguments.size(); i++)
-        args.push_back(generator.newLocal());
+    std::vector<Register> args = generator.newArguments(arguments.size());
     for (size_t i = 0; i < arguments.size(); i++)
         arguments[i]->generate(generator, args[i]);
+
+    auto* identifier = dynamic_cast<Identifier*>(callee.get());
+    if (identifier && identifier->isOperator && args.size() == 2 && generator.numericOperator(dst, calleeReg, identifier->name, args[0], args[1]))
+        return;
+    // Running out of registers in the callee is reported here
+    generator.emitLocation(location);
     generator.call(dst, calleeReg, args);
 }
 
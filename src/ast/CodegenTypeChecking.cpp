@@ -91,9 +91,7 @@ void CallExpression::generateForTypeChecking(TypeChecker& tc, Register dst)
 {
     Register calleeReg = tc.generator().newLocal();
     callee->generateForTypeChecking(tc, calleeReg);
-    std::vector<Register> args;
-    for (size_t i = 0; i < arguments.size(); i++)
-        args.push_back(tc.generator().newLocal());
+    std::vector<Register> args = tc.generator().newArguments(arguments.size());
     for (size_t i = 0; i < arguments.size(); i++)
         arguments[i]->generateForTypeChecking(tc, args[i]);
     tc.generator().newCallHole(dst, calleeReg, args);
@@ -27,6 +27,12 @@ Value& BytecodeBlock::constant(uint32_t index) const
     return m_constants[index];
 }
 
+FieldCache& BytecodeBlock::fieldCache(uint32_t index) const
+{
+    ASSERT(index < m_fieldCaches.size(), "Field cache out of bounds");
+    return m_fieldCaches[index];
+}
+
 BytecodeBlock& BytecodeBlock::functionBlock(uint32_t index) const
 {
     ASSERT(index < m_functionBlocks.size(), "Function out of bounds");
@@ -35,6 +41,7 @@ BytecodeBlock& BytecodeBlock::functionBlock(uint32_t index) const
 
 uint32_t BytecodeBlock::addFunctionBlock(BytecodeBlock* block)
 {
+    Heap::WriteBarrier barrier(this);
     uint32_t functionIndex = m_functionBlocks.size();
     m_functionBlocks.emplace_back(std::move(block));
     m_functions.emplace_back(nullptr);
@@ -50,6 +57,7 @@ Function* BytecodeBlock::function(uint32_t index) const
 void BytecodeBlock::setFunction(uint32_t index, Function* function)
 {
     ASSERT(index < m_functions.size(), "Trying to set function out of bounds");
+    Heap::WriteBarrier barrier(this);
     m_functions[index] = function;
 }
 
@@ -67,8 +75,16 @@ void BytecodeBlock::visit(const Visitor& visitor) const
 
 void BytecodeBlock::dump(std::ostream& out) const
 {
-    out << "BytecodeBlock: " << m_name << ", locals: " << m_numLocals << std::endl;
-    m_instructions.dump(out);
+    out << "BytecodeBlock: " << m_name << std::endl;
+    if (m_checkCode.instructions.size()) {
+        out << "    Type checking, locals: " << m_checkCode.numLocals << std::endl;
+        m_checkCode.instructions.dump(out);
+    }
+    out << "    Code, locals: " << m_code.numLocals << ", captured: " << m_numCapturedVariables;
+    if (!m_needsEnvironment)
+        out << ", no environment";
+    out << std::endl;
+    m_code.instructions.dump(out);
     out << std::endl << "    Constants: " << std::endl;
     for (unsigned i = 0; i < m_constants.size(); i++)
         out << std::setw(8) << i << ": " << Value::SafeDump(m_constants[i]) << std::endl;
@@ -83,7 +99,8 @@ void BytecodeBlock::dump(std::ostream& out) const
 
 bool BytecodeBlock::optimize(VM& vm) const
 {
-    if (std::getenv("NO_JIT"))
+    // Profiling only sees the instructions that go through the interpreter
+    if (std::getenv("NO_JIT") || vm.instructionPairProfile)
         return false;
 
     if (++m_hitCount > optimizationThreshold()) {
@@ -98,13 +115,18 @@ void* BytecodeBlock::jitCode() const
     return m_jitCode;
 }
 
-auto BytecodeBlock::locationInfo(InstructionStream::Offset bytecodeOffset) const -> LocationInfoWithFile
+auto BytecodeBlock::locationInfo(InstructionStream::Offset bytecodeOffset, Code code) const -> LocationInfoWithFile
 {
+    const std::vector<LocationInfo>& locationInfos = stream(code).locationInfos;
+    // Most of the code that runs the block has no locations of its own
+    if (locationInfos.empty())
+        return { nullptr, { static_cast<uint32_t>(bytecodeOffset), { }, { } } };
+
     int low = 0;
-    int high = m_locationInfos.size();
+    int high = locationInfos.size();
     while (low < high) {
         int mid = low + (high - low) / 2;
-        if (m_locationInfos[mid].bytecodeOffset <= bytecodeOffset)
+        if (locationInfos[mid].bytecodeOffset <= bytecodeOffset)
             low = mid + 1;
         else
             high = mid;
@@ -113,48 +135,60 @@ auto BytecodeBlock::locationInfo(InstructionStream::Offset bytecodeOffset) const
     if (!low)
         low = 1;
 
-    const LocationInfo& info = m_locationInfos[low - 1];
+    const LocationInfo& info = locationInfos[low - 1];
     return { m_filename, info };
 }
 
-void BytecodeBlock::addLocation(const SourceLocation& location)
+void BytecodeBlock::addLocation(Code code, const SourceLocation& location)
 {
     ASSERT(!m_filename || location.file.name == m_filename, "OOPS");
     if (!m_filename)
         m_filename = location.file.name;
-    if (m_locationInfos.size()) {
-        const LocationInfo& info = m_locationInfos.back();
+    Stream& stream = this->stream(code);
+    if (stream.locationInfos.size()) {
+        const LocationInfo& info = stream.locationInfos.back();
         if (info.start == location.start && info.end == location.end)
             return;
-        if (info.bytecodeOffset == m_instructions.size())
+        if (info.bytecodeOffset == stream.instructions.size())
             return;
     }
-    m_locationInfos.emplace_back(LocationInfo { static_cast<uint32_t>(m_instructions.size()) - m_prologueSize, location.start, location.end });
+    stream.locationInfos.emplace_back(LocationInfo { static_cast<uint32_t>(stream.instructions.size()) - stream.prologueSize, location.start, location.end });
 }
 
+// Only the type checking code has a prologue
 void BytecodeBlock::emitPrologue(const std::function<void()>& functor)
 {
-    size_t initialSize = m_instructions.size();
+    size_t initialSize = m_checkCode.instructions.size();
     functor();
-    size_t diff = m_instructions.size() - initialSize;
-    m_prologueSize += diff;
-    ASSERT(!m_codeStart, "OOPS");
+    size_t diff = m_checkCode.instructions.size() - initialSize;
+    m_checkCode.prologueSize += diff;
+    ASSERT(!m_code.instructions.size(), "OOPS");
 }
 
 void BytecodeBlock::adjustOffsets()
 {
-    LocationInfo* lastInfo = nullptr;
-    for (LocationInfo& info : m_locationInfos) {
-        ASSERT(!lastInfo || lastInfo->bytecodeOffset <= info.bytecodeOffset, "Inconsistent location info");
-        lastInfo = &info;
-    }
-    for (LocationInfo& info : m_locationInfos) {
-        if (info.bytecodeOffset > m_prologueSize)
-            info.bytecodeOffset += m_prologueSize;
-    }
-    lastInfo = nullptr;
-    for (LocationInfo& info : m_locationInfos) {
-        ASSERT(!lastInfo || lastInfo->bytecodeOffset <= info.bytecodeOffset, "Inconsistent location info");
-        lastInfo = &info;
+    for (Stream* stream : { &m_checkCode, &m_code }) {
+        LocationInfo* lastInfo = nullptr;
+        for (LocationInfo& info : stream->locationInfos) {
+            ASSERT(!lastInfo || lastInfo->bytecodeOffset <= info.bytecodeOffset, "Inconsistent location info");
+            lastInfo = &info;
+        }
+        for (LocationInfo& info : stream->locationInfos) {
+            if (info.bytecodeOffset > stream->prologueSize)
+                info.bytecodeOffset += stream->prologueSize;
+        }
+        lastInfo = nullptr;
+        for (LocationInfo& info : stream->locationInfos) {
+            ASSERT(!lastInfo || lastInfo->bytecodeOffset <= info.bytecodeOffset, "Inconsistent location info");
+            lastInfo = &info;
+        }
     }
 }
+
+// Nothing runs the type checking code once it has succeeded
+void BytecodeBlock::releaseCheckCode()
+{
+    m_checkCode.instructions.clear();
+    m_checkCode.numLocals = 0;
+    std::vector<LocationInfo>().swap(m_checkCode.locationInfos);
+}
@@ -2,6 +2,7 @@
 
 #include "Cell.h"
 #include "InstructionStream.h"
+#include "Shape.h"
 #include "SourceLocation.h"
 #include "Value.h"
 #include "expressions.h"
@@ -13,22 +14,39 @@ class Function;
 
 class BytecodeBlock : public Cell {
     friend class BytecodeGenerator;
+    friend class BytecodeOptimizer;
+    friend class RegisterAllocator;
 
 public:
     CELL(BytecodeBlock)
 
+    // A block has two separate streams of code, each with its own frame and
+    // source locations. The type checking code runs once, before the block is
+    // first used, and returns its type. Once that succeeds, only the code that
+    // runs the block is kept.
+    enum class Code : uint8_t {
+        Check,
+        Run,
+    };
+
     void visit(const Visitor&) const;
     void dump(std::ostream&) const;
 
     const std::string& name() const { return m_name; }
-    InstructionStream& instructions() { return m_instructions; }
-    const InstructionStream& instructions() const { return m_instructions; }
-    uint32_t numLocals() const { return m_numLocals; }
+    InstructionStream& instructions(Code code = Code::Run) { return stream(code).instructions; }
+    const InstructionStream& instructions(Code code = Code::Run) const { return stream(code).instructions; }
+    uint32_t numLocals(Code code = Code::Run) const { return stream(code).numLocals; }
     Register environmentRegister() const { return m_environmentRegister; }
-    InstructionStream::Offset codeStart() const { return m_codeStart; };
+    // The free variables of the function, which each of its closures copies
+    uint32_t numCapturedVariables() const { return m_numCapturedVariables; }
+    // Whether each run of the code needs an environment of its own, as opposed
+    // to running right in the environment of its function
+    bool needsEnvironment() const { return m_needsEnvironment; }
+    void releaseCheckCode();
 
     const std::string& identifier(uint32_t) const;
     Value& constant(uint32_t) const;
+    FieldCache& fieldCache(uint32_t) const;
     BytecodeBlock& functionBlock(uint32_t) const;
     uint32_t addFunctionBlock(BytecodeBlock*);
     Function* function(uint32_t) const;
@@ -37,34 +55,51 @@ public:
     bool optimize(VM&) const;
     void* jitCode() const;
 
-    void addLocation(const SourceLocation&);
+    void addLocation(Code, const SourceLocation&);
 
-    LocationInfoWithFile locationInfo(InstructionStream::Offset) const;
+    LocationInfoWithFile locationInfo(InstructionStream::Offset, Code = Code::Run) const;
 
 private:
+    struct Stream {
+        InstructionStream instructions;
+        uint32_t numLocals { 0 };
+        // Instructions inserted right after Enter while generating the rest
+        uint32_t prologueSize { 0 };
+        std::vector<LocationInfo> locationInfos;
+    };
+
     BytecodeBlock(std::string);
 
+    Stream& stream(Code code) { return code == Code::Check ? m_checkCode : m_code; }
+    const Stream& stream(Code code) const { return code == Code::Check ? m_checkCode : m_code; }
+
     void emitPrologue(const std::function<void()>&);
     void adjustOffsets();
 
     template<typename JumpType, typename Label>
-    void recordJump(Label& label)
+    void recordJump(Code code, Label& label)
     {
-        m_instructions.recordJump<JumpType>(m_prologueSize, label);
+        Stream& stream = this->stream(code);
+        stream.instructions.recordJump<JumpType>(stream.prologueSize, label);
     }
 
+    // Locals handed out while generating, shared by both streams until they
+    // are allocated separately
     uint32_t m_numLocals { 0 };
-    uint32_t m_prologueSize { 0 };
-    InstructionStream::Offset m_codeStart { 0 };
     Register m_environmentRegister;
+    uint32_t m_numCapturedVariables { 0 };
+    bool m_needsEnvironment { true };
     std::string m_name;
     const char* m_filename { nullptr };
-    InstructionStream m_instructions;
+    Stream m_checkCode;
+    Stream m_code;
     mutable std::vector<Value> m_constants;
+    // Written as the code runs. The JIT refers to them, so they never move
+    // once the block is generated.
+    mutable std::vector<FieldCache> m_fieldCaches;
     std::vector<std::string> m_identifiers;
     std::vector<BytecodeBlock*> m_functionBlocks;
     std::vector<Function*> m_functions;
-    std::vector<LocationInfo> m_locationInfos;
 
     // JIT
     mutable uint32_t m_hitCount = 0;
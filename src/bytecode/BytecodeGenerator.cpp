@@ -1,10 +1,25 @@
 #include "BytecodeGenerator.h"
+#include "BytecodeOptimizer.h"
 #include "Instructions.h"
+#include "NumericOperators.h"
+#include "RegisterAllocator.h"
+
+BytecodeGenerator::LexicalScope::LexicalScope(BytecodeGenerator& generator)
+    : m_generator(generator)
+{
+    m_generator.m_scopes.emplace_back();
+}
+
+BytecodeGenerator::LexicalScope::~LexicalScope()
+{
+    m_generator.m_scopes.pop_back();
+}
 
 BytecodeGenerator::BytecodeGenerator(VM& vm, std::string name)
     : m_vm(vm)
     , m_block(vm, name)
 {
+    m_scopes.emplace_back();
     emit<Enter>();
 }
 
@@ -13,20 +28,98 @@ BytecodeGenerator::~BytecodeGenerator()
     m_block.destroy(m_vm);
 }
 
-BytecodeBlock* BytecodeGenerator::finalize(Register result)
+BytecodeBlock* BytecodeGenerator::finalize(Register result, bool allowsTailCalls)
 {
+    ASSERT(m_code == BytecodeBlock::Code::Run, "Finalizing a block before the end of its type checking code");
     emit<End>(result);
     m_block->adjustOffsets();
-    if (std::getenv("DUMP_BYTECODE"))
-        m_block->dump(std::cout);
+    if (m_vm.dumpBytecode) {
+        std::cerr << "Before optimization:" << std::endl;
+        m_block->dump(std::cerr);
+    }
+    for (auto code : { BytecodeBlock::Code::Check, BytecodeBlock::Code::Run }) {
+        m_block->stream(code).numLocals = m_block->m_numLocals;
+        if (!m_block->instructions(code).size())
+            continue;
+        BytecodeOptimizer(*m_block, code).optimize(m_vm.dumpBytecode ? &std::cerr : nullptr);
+        if (code == BytecodeBlock::Code::Run && allowsTailCalls)
+            rewriteTailCalls();
+        if (code == BytecodeBlock::Code::Run)
+            elideEnvironment();
+        RegisterAllocator(*m_block, code).allocate();
+    }
+    if (m_vm.dumpBytecode) {
+        std::cerr << "After optimization:" << std::endl;
+        m_block->dump(std::cerr);
+    }
     return m_block.get();
 }
 
+// Turn calls whose result is returned right away, possibly after following
+// some jumps, into tail calls. TailCall has the same layout as Call, so this
+// only rewrites the opcode.
+void BytecodeGenerator::rewriteTailCalls()
+{
+    InstructionStream& instructions = m_block->instructions();
+    for (auto instruction = instructions.begin(); instruction != instructions.end(); ++instruction) {
+        if (instruction->id != Call::ID)
+            continue;
+        Register result = reinterpret_cast<const Call*>(instruction.get())->dst;
+
+        auto next = instruction;
+        ++next;
+        while (next->id == Jump::ID)
+            next += reinterpret_cast<const Jump*>(next.get())->target;
+        if (next->id == End::ID && result == reinterpret_cast<const End*>(next.get())->value)
+            instructions.m_instructions[instruction.offset()] = TailCall::ID;
+    }
+}
+
+// Variables live in registers, or in the environment of the closures that
+// capture them, so the code only needs an environment of its own if it binds
+// names. Otherwise, it runs right in the environment of its function, and its
+// captured variables are one environment closer.
+void BytecodeGenerator::elideEnvironment()
+{
+    InstructionStream& instructions = m_block->instructions();
+    for (auto instruction = instructions.begin(); instruction != instructions.end(); ++instruction) {
+        switch (instruction->id) {
+        // Binds a name in the current environment
+        case SetLocal::ID:
+            return;
+        // Push an environment on top of the current one and bind names in it
+        case PushScope::ID:
+        case PopScope::ID:
+        case PushUnificationScope::ID:
+        case PopUnificationScope::ID:
+            return;
+        default:
+            break;
+        }
+    }
+
+    m_block->m_needsEnvironment = false;
+    for (auto instruction = instructions.begin(); instruction != instructions.end(); ++instruction) {
+        if (instruction->id == GetCapturedVariable::ID)
+            reinterpret_cast<GetCapturedVariable*>(&instructions.m_instructions[instruction.offset()])->depth--;
+    }
+}
+
 Register BytecodeGenerator::newLocal()
 {
     return Register::forLocal(++m_block->m_numLocals);
 }
 
+std::vector<Register> BytecodeGenerator::newArguments(unsigned count)
+{
+    // Locals grow towards lower addresses, so hand them out in reverse
+    m_block->m_numLocals += count;
+    std::vector<Register> arguments;
+    for (unsigned i = 0; i < count; i++)
+        arguments.push_back(Register::forLocal(m_block->m_numLocals - i));
+    return arguments;
+}
+
 Label BytecodeGenerator::label()
 {
     return Label { };
@@ -46,19 +139,23 @@ void BytecodeGenerator::branch(Register condition, const std::function<void()>&
 
 void BytecodeGenerator::emitLocation(const SourceLocation& location)
 {
-    m_block->addLocation(location);
+    m_block->addLocation(m_code, location);
 }
 
 void BytecodeGenerator::emitPrologue(const std::function<void()>& functor)
 {
+    ASSERT(m_code == BytecodeBlock::Code::Check, "Only the type checking code has a prologue");
     m_block->emitPrologue([&] {
-        m_block->instructions().emitPrologue(functor);
+        m_block->instructions(m_code).emitPrologue(functor);
     });
 }
 
 void BytecodeGenerator::loadConstant(Register dst, Value value)
 {
-    m_block->m_constants.push_back(value);
+    {
+        Heap::WriteBarrier barrier(m_block.get());
+        m_block->m_constants.push_back(value);
+    }
     emit<LoadConstant>(dst, m_block->m_constants.size() - 1);
 }
 
@@ -70,7 +167,10 @@ void BytecodeGenerator::loadConstantIndex(Register dst, uint32_t index)
 uint32_t BytecodeGenerator::storeConstant(Register value)
 {
     uint32_t constantIndex = m_block->m_constants.size();
-    m_block->m_constants.push_back(Value::crash());
+    {
+        Heap::WriteBarrier barrier(m_block.get());
+        m_block->m_constants.push_back(Value::crash());
+    }
     emit<StoreConstant>(constantIndex, value);
     return constantIndex;
 }
@@ -82,6 +182,23 @@ void BytecodeGenerator::getLocal(Register dst, const Identifier& ident)
 
 void BytecodeGenerator::getLocal(Register dst, const std::string& ident)
 {
+    if (m_code == BytecodeBlock::Code::Run) {
+        if (Variable* variable = lookupVariable(ident)) {
+            move(dst, variable->reg);
+            return;
+        }
+
+        if (auto slot = capture(ident)) {
+            emit<GetCapturedVariable>(dst, 1, *slot, uniqueIdentifier(ident));
+            return;
+        }
+
+        if (auto cellIndex = m_vm.globalCellIndex(ident)) {
+            emit<GetGlobal>(dst, *cellIndex, uniqueIdentifier(ident));
+            return;
+        }
+    }
+
     uint32_t index = uniqueIdentifier(ident);
     emit<GetLocal>(dst, index);
 }
@@ -90,7 +207,10 @@ void BytecodeGenerator::getLocalOrConstant(Register dst, const std::string& iden
 {
     uint32_t identIndex = uniqueIdentifier(ident);
     uint32_t constantIndex = m_block->m_constants.size();
-    m_block->m_constants.push_back(constant);
+    {
+        Heap::WriteBarrier barrier(m_block.get());
+        m_block->m_constants.push_back(constant);
+    }
     emit<GetLocalOrConstant>(dst, identIndex, constantIndex);
 }
 
@@ -101,8 +221,76 @@ void BytecodeGenerator::setLocal(const Identifier& ident, Register src)
 
 void BytecodeGenerator::setLocal(const std::string& ident, Register src)
 {
-    uint32_t index = uniqueIdentifier(ident);
-    emit<SetLocal>(index, src);
+    if (m_code == BytecodeBlock::Code::Check || isTopLevel()) {
+        uint32_t index = uniqueIdentifier(ident);
+        emit<SetLocal>(index, src);
+        return;
+    }
+
+    // Binding a name again makes a new variable, unless it was only declared
+    Scope& scope = m_scopes.back();
+    auto it = scope.variables.find(ident);
+    if (it == scope.variables.end() || it->second.isInitialized)
+        it = scope.variables.insert_or_assign(ident, Variable { newLocal() }).first;
+    Variable& variable = it->second;
+    move(variable.reg, src);
+    variable.isInitialized = true;
+
+    // The closures created earlier in this scope see the new binding, as they
+    // would if they looked the name up when called
+    auto copies = scope.capturedCopies.equal_range(ident);
+    for (auto copy = copies.first; copy != copies.second; ++copy)
+        emit<SetCapturedVariable>(copy->second.closure, copy->second.slot, variable.reg);
+}
+
+void BytecodeGenerator::setParameter(const std::string& ident, uint32_t index)
+{
+    ASSERT(m_code == BytecodeBlock::Code::Run, "Type checking code binds parameters by name");
+    m_scopes.back().variables.insert_or_assign(ident, Variable { Register::forParameter(index), true });
+}
+
+void BytecodeGenerator::declareLocal(const std::string& ident)
+{
+    ASSERT(m_code == BytecodeBlock::Code::Run, "Type checking code binds variables by name");
+    if (isTopLevel())
+        return;
+    m_scopes.back().variables.insert_or_assign(ident, Variable { newLocal() });
+}
+
+// The top level binds names in its environment rather than in registers, since
+// functions must see the declarations that come after them, and that shadow a
+// name they already read. Binding a name of the global environment also fires
+// the watchpoint of its cell, so functions that read the global from then on
+// find the new binding instead.
+bool BytecodeGenerator::isTopLevel() const
+{
+    return !m_parent && m_scopes.size() == 1;
+}
+
+auto BytecodeGenerator::lookupVariable(const std::string& ident) -> Variable*
+{
+    for (auto scope = m_scopes.rbegin(); scope != m_scopes.rend(); ++scope) {
+        auto it = scope->variables.find(ident);
+        if (it != scope->variables.end())
+            return &it->second;
+    }
+    return nullptr;
+}
+
+// A variable of an enclosing function becomes a free variable of this one. The
+// functions in between capture it too, so that each closure can copy it from
+// the one that creates it.
+std::optional<uint32_t> BytecodeGenerator::capture(const std::string& ident)
+{
+    auto it = m_capturedVariables.find(ident);
+    if (it != m_capturedVariables.end())
+        return it->second;
+    if (!m_parent || (!m_parent->lookupVariable(ident) && !m_parent->capture(ident)))
+        return std::nullopt;
+
+    uint32_t slot = m_block->m_numCapturedVariables++;
+    m_capturedVariables.emplace(ident, slot);
+    return slot;
 }
 
 void BytecodeGenerator::call(Register dst, Register callee, const std::vector<Register>& args)
@@ -111,6 +299,19 @@ void BytecodeGenerator::call(Register dst, Register callee, const std::vector<Re
     emit<Call>(dst, callee, argc, argc ? args[0] : Register::forParameter(0));
 }
 
+bool BytecodeGenerator::numericOperator(Register dst, Register callee, const std::string& name, Register lhs, Register rhs)
+{
+#define EMIT_NUMERIC_OPERATOR(Instruction, operatorName, resultType, expression) \
+    if (name == operatorName) { \
+        emit<Instruction>(dst, callee, lhs, rhs); \
+        return true; \
+    }
+FOR_EACH_NUMERIC_OPERATOR(EMIT_NUMERIC_OPERATOR)
+#undef EMIT_NUMERIC_OPERATOR
+
+    return false;
+}
+
 void BytecodeGenerator::newArray(Register dst, Register type, unsigned size)
 {
     emit<NewArray>(dst, type, size);
@@ -146,16 +347,47 @@ void BytecodeGenerator::getTupleIndex(Register dst, Register tuple, Register ind
     emit<GetTupleIndex>(dst, tuple, index);
 }
 
-uint32_t BytecodeGenerator::newFunction(Register dst, BytecodeBlock* block)
+uint32_t BytecodeGenerator::newFunction(Register dst, std::unique_ptr<BytecodeGenerator> generator)
 {
-    uint32_t functionIndex = m_block->addFunctionBlock(block);
+    uint32_t functionIndex = m_block->addFunctionBlock(generator->m_block.get());
     emit<NewFunction>(dst, functionIndex);
+    generator->m_parent = this;
+    m_functionGenerators.emplace(functionIndex, std::move(generator));
     return functionIndex;
 }
 
+BytecodeGenerator& BytecodeGenerator::functionGenerator(uint32_t functionIndex)
+{
+    ASSERT(m_code == BytecodeBlock::Code::Run, "Functions are generated along with the code that runs the block");
+    auto it = m_functionGenerators.find(functionIndex);
+    ASSERT(it != m_functionGenerators.end(), "Function was already generated: %u", functionIndex);
+    return *it->second;
+}
+
 void BytecodeGenerator::newFunction(Register dst, uint32_t functionIndex)
 {
+    auto it = m_functionGenerators.find(functionIndex);
+    ASSERT(it != m_functionGenerators.end(), "Function was already generated: %u", functionIndex);
     emit<NewFunction>(dst, functionIndex);
+    std::optional<Register> closure;
+    for (const auto& [ident, slot] : it->second->m_capturedVariables) {
+        if (!closure) {
+            closure = newLocal();
+            move(*closure, dst);
+        }
+        m_scopes.back().capturedCopies.emplace(ident, CapturedCopy { *closure, slot });
+
+        // The only variable that's declared but not bound yet is the one the
+        // function itself is about to be bound to, which updates the copy
+        Variable* variable = lookupVariable(ident);
+        if (variable && !variable->isInitialized)
+            continue;
+        Register value = variable ? variable->reg : newLocal();
+        if (!variable)
+            getLocal(value, ident);
+        emit<SetCapturedVariable>(dst, slot, value);
+    }
+    m_functionGenerators.erase(it);
 }
 
 void BytecodeGenerator::move(Register from, Register to)
@@ -173,31 +405,31 @@ void BytecodeGenerator::newObject(Register dst, Register type, uint32_t inlineSi
 void BytecodeGenerator::setField(Register object, const std::string& field, Register value)
 {
     uint32_t fieldIndex = uniqueIdentifier(field);
-    emit<SetField>(object, fieldIndex, value);
+    emit<SetField>(object, fieldIndex, value, newFieldCache());
 }
 
 void BytecodeGenerator::getField(Register dst, Register object, const std::string& field)
 {
     uint32_t fieldIndex = uniqueIdentifier(field);
-    emit<GetField>(dst, object, fieldIndex);
+    emit<GetField>(dst, object, fieldIndex, newFieldCache());
 }
 
 void BytecodeGenerator::tryGetField(Register dst, Register object, const std::string& field, Label& target)
 {
-    m_block->recordJump<TryGetField>(target);
+    m_block->recordJump<TryGetField>(m_code, target);
     uint32_t fieldIndex = uniqueIdentifier(field);
-    emit<TryGetField>(dst, object, fieldIndex, 0);
+    emit<TryGetField>(dst, object, fieldIndex, newFieldCache(), 0);
 }
 
 void BytecodeGenerator::jump(Label& target)
 {
-    m_block->recordJump<Jump>(target);
+    m_block->recordJump<Jump>(m_code, target);
     emit<Jump>(0);
 }
 
 void BytecodeGenerator::jumpIfFalse(Register condition, Label& target)
 {
-    m_block->recordJump<JumpIfFalse>(target);
+    m_block->recordJump<JumpIfFalse>(m_code, target);
     emit<JumpIfFalse>(condition, 0);
 }
 
@@ -278,8 +510,17 @@ void BytecodeGenerator::inferImplicitParameters(Register function, const std::ve
 
 void BytecodeGenerator::endTypeChecking(Register type)
 {
+    ASSERT(m_code == BytecodeBlock::Code::Check, "Type checking already ended");
     emit<End>(type);
-    m_block->m_codeStart = m_block->instructions().size();
+    m_code = BytecodeBlock::Code::Run;
+    emit<Enter>();
+}
+
+void BytecodeGenerator::skipTypeChecking()
+{
+    ASSERT(m_code == BytecodeBlock::Code::Check, "Type checking already ended");
+    m_block->instructions(m_code).clear();
+    m_code = BytecodeBlock::Code::Run;
     emit<Enter>();
 }
 
@@ -385,12 +626,12 @@ void BytecodeGenerator::emit(Register reg)
 
 void BytecodeGenerator::emit(Label& label)
 {
-    label.link(m_block->m_prologueSize, m_block->instructions().end());
+    label.link(m_block->stream(m_code).prologueSize, m_block->instructions(m_code).end());
 }
 
 void BytecodeGenerator::emit(uint32_t word)
 {
-    m_block->instructions().emit(word);
+    m_block->instructions(m_code).emit(word);
 }
 
 template<typename T>
@@ -410,3 +651,10 @@ uint32_t BytecodeGenerator::uniqueIdentifier(const std::string& ident)
     m_uniqueIdentifierMapping[ident] = index;
     return index;
 }
+
+uint32_t BytecodeGenerator::newFieldCache()
+{
+    uint32_t cacheIndex = m_block->m_fieldCaches.size();
+    m_block->m_fieldCaches.emplace_back();
+    return cacheIndex;
+}
@@ -10,17 +10,33 @@
 #include <string>
 #include <memory>
 #include <map>
+#include <optional>
 
 class BytecodeGenerator {
 public:
+    // Variables bound while a scope is alive are only visible until it ends
+    class LexicalScope {
+    public:
+        LexicalScope(BytecodeGenerator&);
+        ~LexicalScope();
+
+    private:
+        BytecodeGenerator& m_generator;
+    };
+
     BytecodeGenerator(VM&, std::string = "<global>");
     ~BytecodeGenerator();
 
     VM& vm() { return m_vm; }
     BytecodeBlock& block() { return *m_block; }
 
-    BytecodeBlock* finalize(Register);
+    // Only function bodies allow tail calls: the frame of the top-level program
+    // has to outlive its last call.
+    BytecodeBlock* finalize(Register, bool allowsTailCalls = false);
     Register newLocal();
+    // Consecutive locals for the arguments of a call, at increasing addresses,
+    // so that the callee can read them straight from the caller's frame
+    std::vector<Register> newArguments(unsigned);
     Label label();
     void branch(Register, const std::function<void()>&, const std::function<void()>&);
 
@@ -30,12 +46,27 @@ public:
     void loadConstant(Register, Value);
     void loadConstantIndex(Register, uint32_t);
     uint32_t storeConstant(Register);
+
+    // Type checking code looks variables up by name. The code that runs the
+    // block resolves them as it's generated instead: its own variables live in
+    // registers, those of enclosing functions are read from the slot of the
+    // closure they were copied to, and anything else is looked up by name, e.g.
+    // builtins and the declarations of the top level, which it binds by name.
     void getLocal(Register, const Identifier&);
     void setLocal(const Identifier&, Register);
     void getLocal(Register, const std::string&);
     void getLocalOrConstant(Register, const std::string&, Value);
     void setLocal(const std::string&, Register);
+    // Parameters are read straight from the caller's frame
+    void setParameter(const std::string&, uint32_t);
+    // Binds a name ahead of its value, so that functions generated before the
+    // setLocal that follows can capture it
+    void declareLocal(const std::string&);
+
     void call(Register, Register, const std::vector<Register>&);
+    // A call to one of the operators in NumericOperators.h, through its own
+    // instruction. Returns false if `name` isn't one of them.
+    bool numericOperator(Register dst, Register callee, const std::string& name, Register lhs, Register rhs);
     void newArray(Register, Register, unsigned);
     void setArrayIndex(Register, unsigned, Register);
     void getArrayIndex(Register, Register, Register);
@@ -43,7 +74,13 @@ public:
     void newTuple(Register, Register, unsigned);
     void setTupleIndex(Register, unsigned, Register);
     void getTupleIndex(Register, Register, Register);
-    uint32_t newFunction(Register, BytecodeBlock*);
+    // Functions are type checked along with the code around them, but the code
+    // that runs them is only generated once the enclosing code is, since that's
+    // what their variables resolve to. The generator of each function is kept
+    // until then, and dropped by the run code's newFunction, which copies the
+    // variables that the function captures into each new closure.
+    uint32_t newFunction(Register, std::unique_ptr<BytecodeGenerator>);
+    BytecodeGenerator& functionGenerator(uint32_t);
     void newFunction(Register, uint32_t);
     void move(Register dst, Register src);
     void newObject(Register, Register, uint32_t);
@@ -69,6 +106,8 @@ public:
     void typeError(const SourceLocation&, const char*);
     void inferImplicitParameters(Register, const std::vector<Register>&);
     void endTypeChecking(Register);
+    // For blocks that only ever run, e.g. to build the value of a hole
+    void skipTypeChecking();
 
     // Types
     void newVarType(Register, const std::string&, bool, bool, Register);
@@ -103,9 +142,44 @@ private:
         Instruction::emit(this, std::forward<Args>(args)...);
     }
 
+    // A variable of the code that runs the block, which lives in a register
+    struct Variable {
+        Register reg;
+        bool isInitialized { false };
+    };
+
+    // The slot of a closure that holds its copy of a variable it captured
+    struct CapturedCopy {
+        Register closure;
+        uint32_t slot;
+    };
+
+    struct Scope {
+        std::map<std::string, Variable> variables;
+        // The copies held by the closures created in this scope, by name
+        std::multimap<std::string, CapturedCopy> capturedCopies;
+    };
+
+    Variable* lookupVariable(const std::string&);
+    bool isTopLevel() const;
+    // The slot of a variable of an enclosing function in the closure, if any
+    std::optional<uint32_t> capture(const std::string&);
+
     uint32_t uniqueIdentifier(const std::string&);
+    uint32_t newFieldCache();
+    void rewriteTailCalls();
+    void elideEnvironment();
 
     VM& m_vm;
     GC<BytecodeBlock> m_block;
+    // The stream that instructions are emitted to
+    BytecodeBlock::Code m_code { BytecodeBlock::Code::Check };
     std::map<std::string, uint32_t> m_uniqueIdentifierMapping;
+
+    // The generator of the enclosing function, which is generating its own run
+    // code while this one is
+    BytecodeGenerator* m_parent { nullptr };
+    std::vector<Scope> m_scopes;
+    std::map<uint32_t, std::unique_ptr<BytecodeGenerator>> m_functionGenerators;
+    std::map<std::string, uint32_t> m_capturedVariables;
 };
@@ -0,0 +1,495 @@
+#include "BytecodeOptimizer.h"
+
+#include "BytecodeBlock.h"
+#include <algorithm>
+#include <iterator>
+#include <type_traits>
+#include <unordered_map>
+
+// Collects the words of a single instruction, through the same interface the
+// instructions use to emit themselves into a BytecodeGenerator
+struct InstructionWords {
+    void emit(uint32_t word) { words.push_back(word); }
+    void emit(Register reg) { words.push_back(reg.offset()); }
+
+    template<typename T>
+    std::enable_if_t<std::is_enum<T>::value, void> emit(T t) { emit(static_cast<std::underlying_type_t<T>>(t)); }
+
+    std::vector<uint32_t> words;
+};
+
+BytecodeOptimizer::BytecodeOptimizer(BytecodeBlock& block, BytecodeBlock::Code code)
+    : m_block(block)
+    , m_code(code)
+{
+}
+
+void BytecodeOptimizer::optimize(std::ostream* stats)
+{
+    struct Pass {
+        const char* name;
+        bool (BytecodeOptimizer::*run)();
+        size_t removedInstructions;
+    };
+
+    Pass passes[] = {
+        { "jump threading", &BytecodeOptimizer::threadJumps, 0 },
+        { "unreachable code", &BytecodeOptimizer::removeUnreachableCode, 0 },
+        { "constant folding", &BytecodeOptimizer::foldConstants, 0 },
+        { "copy propagation", &BytecodeOptimizer::propagateCopies, 0 },
+        { "dead stores", &BytecodeOptimizer::removeDeadStores, 0 },
+        // Last, since the other passes don't know about superinstructions
+        { "superinstructions", &BytecodeOptimizer::fuseInstructions, 0 },
+    };
+    Pass& fusion = passes[std::size(passes) - 1];
+
+    auto instructionCount = [&] {
+        size_t count = 0;
+        for (auto it = instructions().begin(); it != instructions().end(); ++it)
+            count++;
+        return count;
+    };
+
+    size_t initialCount = instructionCount();
+    size_t count = initialCount;
+    auto run = [&](Pass& pass) {
+        if (!(this->*pass.run)() || !compact())
+            return false;
+        size_t newCount = instructionCount();
+        pass.removedInstructions += count - newCount;
+        count = newCount;
+        return true;
+    };
+
+    for (bool changed = true; changed;) {
+        changed = false;
+        for (Pass& pass : passes) {
+            if (&pass != &fusion)
+                changed |= run(pass);
+        }
+    }
+    run(fusion);
+
+    if (!stats)
+        return;
+    *stats << "Optimized " << m_block.name() << ": " << initialCount << " -> " << count << " instructions" << std::endl;
+    for (const Pass& pass : passes)
+        *stats << "    " << pass.name << ": -" << pass.removedInstructions << std::endl;
+    *stats << std::endl;
+}
+
+// Jumps to jumps go straight to the final target, jumps to End return right
+// away and jumps to the next instruction are removed
+bool BytecodeOptimizer::threadJumps()
+{
+    Liveness liveness = computeLiveness();
+    const std::vector<Node>& nodes = liveness.nodes();
+    bool changed = false;
+    for (uint32_t index = 0; index < nodes.size(); index++) {
+        const Node& node = nodes[index];
+        if (!node.target)
+            continue;
+
+        // Bounded, since jumps may form a loop
+        uint32_t target = *node.target;
+        for (size_t i = 0; i < nodes.size() && nodes[target].instruction->id == Jump::ID; i++)
+            target = *nodes[target].target;
+
+        Instruction::ID id = node.instruction->id;
+        if (id == Jump::ID && nodes[target].instruction->id == End::ID) {
+            replace<End>(node, reinterpret_cast<const End*>(nodes[target].instruction)->value);
+            changed = true;
+        } else if (target == index + 1 && (id == Jump::ID || id == JumpIfFalse::ID)) {
+            remove(node);
+            changed = true;
+        } else if (target != *node.target) {
+            *Liveness::jumpTarget(node.instruction) = nodes[target].offset - node.offset;
+            changed = true;
+        }
+    }
+    return changed;
+}
+
+bool BytecodeOptimizer::removeUnreachableCode()
+{
+    Liveness liveness = computeLiveness();
+    const std::vector<Node>& nodes = liveness.nodes();
+    std::vector<bool> isReachable(nodes.size());
+    std::vector<uint32_t> worklist;
+    for (uint32_t index = 0; index < nodes.size(); index++) {
+        if (!nodes[index].offset) {
+            isReachable[index] = true;
+            worklist.push_back(index);
+        }
+    }
+
+    while (!worklist.empty()) {
+        const Node& node = nodes[worklist.back()];
+        worklist.pop_back();
+        for (auto successor : { node.next, node.target }) {
+            if (successor && !isReachable[*successor]) {
+                isReachable[*successor] = true;
+                worklist.push_back(*successor);
+            }
+        }
+    }
+
+    bool changed = false;
+    for (uint32_t index = 0; index < nodes.size(); index++) {
+        if (!isReachable[index]) {
+            remove(nodes[index]);
+            changed = true;
+        }
+    }
+    return changed;
+}
+
+// Tracks the locals that hold a known constant within each basic block, to
+// evaluate comparisons and branches on them ahead of time
+bool BytecodeOptimizer::foldConstants()
+{
+    Liveness liveness = computeLiveness();
+    const std::vector<Node>& nodes = liveness.nodes();
+    std::vector<bool> isLeader = leaders(liveness);
+
+    // Constants written by StoreConstant aren't known until the type checking
+    // code runs, and the constants are shared by both streams
+    std::vector<bool> isMutable(m_block.m_constants.size());
+    for (auto code : { BytecodeBlock::Code::Check, BytecodeBlock::Code::Run }) {
+        const InstructionStream& stream = m_block.instructions(code);
+        for (auto instruction = stream.begin(); instruction != stream.end(); ++instruction) {
+            if (instruction->id == StoreConstant::ID)
+                isMutable[reinterpret_cast<const StoreConstant*>(instruction.get())->constantIndex] = true;
+        }
+    }
+
+    std::unordered_map<uint32_t, uint32_t> constants;
+    auto knownConstant = [&](Register reg) -> const Value* {
+        if (!reg.isLocal())
+            return nullptr;
+        auto it = constants.find(-reg.offset());
+        return it == constants.end() ? nullptr : &m_block.constant(it->second);
+    };
+
+    bool changed = false;
+    for (uint32_t index = 0; index < nodes.size(); index++) {
+        const Node& node = nodes[index];
+        if (isLeader[index])
+            constants.clear();
+
+        std::optional<std::pair<Register, uint32_t>> result;
+        switch (node.instruction->id) {
+        case LoadConstant::ID: {
+            auto& load = *reinterpret_cast<const LoadConstant*>(node.instruction);
+            if (!isMutable[load.constantIndex])
+                result = { load.dst, load.constantIndex };
+            break;
+        }
+        case Move::ID: {
+            auto& move = *reinterpret_cast<const Move*>(node.instruction);
+            if (!move.src.isLocal() || !constants.count(-move.src.offset()))
+                break;
+            result = { move.dst, constants[-move.src.offset()] };
+            replace<LoadConstant>(node, move.dst, result->second);
+            changed = true;
+            break;
+        }
+        case IsEqual::ID: {
+            auto& isEqual = *reinterpret_cast<const IsEqual*>(node.instruction);
+            const Value* lhs = knownConstant(isEqual.lhs);
+            const Value* rhs = knownConstant(isEqual.rhs);
+            // Comparing cells may depend on state that's only there at runtime
+            if (!lhs || !rhs || lhs->isCell() || rhs->isCell())
+                break;
+            result = { isEqual.dst, constant(*lhs == *rhs) };
+            replace<LoadConstant>(node, isEqual.dst, result->second);
+            changed = true;
+            break;
+        }
+        case IsCell::ID: {
+            auto& isCell = *reinterpret_cast<const IsCell*>(node.instruction);
+            const Value* value = knownConstant(isCell.value);
+            if (!value)
+                break;
+            result = { isCell.dst, constant(value->isCell() && value->asCell()->kind() == isCell.kind) };
+            replace<LoadConstant>(node, isCell.dst, result->second);
+            changed = true;
+            break;
+        }
+        case JumpIfFalse::ID: {
+            auto& jumpIfFalse = *reinterpret_cast<const JumpIfFalse*>(node.instruction);
+            const Value* condition = knownConstant(jumpIfFalse.condition);
+            if (!condition || !condition->isBool())
+                break;
+            if (condition->asBool())
+                remove(node);
+            else
+                replace<Jump>(node, jumpIfFalse.target);
+            changed = true;
+            break;
+        }
+        default:
+            break;
+        }
+
+        for (uint32_t local : node.defs)
+            constants.erase(local);
+        if (result && result->first.isLocal())
+            constants[-result->first.offset()] = result->second;
+    }
+    return changed;
+}
+
+// Within each basic block, reads of the destination of a Move read its source
+// instead, for as long as neither is overwritten. A Move right after the
+// instruction that computes its source, which dies there, is folded into it.
+bool BytecodeOptimizer::propagateCopies()
+{
+    Liveness liveness = computeLiveness();
+    const std::vector<Node>& nodes = liveness.nodes();
+    std::vector<bool> isLeader = leaders(liveness);
+
+    std::unordered_map<uint32_t, Register> copies;
+    bool changed = false;
+    for (uint32_t index = 0; index < nodes.size(); index++) {
+        const Node& node = nodes[index];
+        if (isLeader[index])
+            copies.clear();
+
+        Liveness::forEachRegister(node.instruction, [&](Register& reg, uint32_t, int32_t step, bool isDef) {
+            // Ranges have to stay in consecutive registers
+            if (isDef || step || !reg.isLocal())
+                return;
+            auto it = copies.find(-reg.offset());
+            if (it == copies.end())
+                return;
+            reg = it->second;
+            changed = true;
+        });
+
+        for (uint32_t local : node.defs) {
+            copies.erase(local);
+            for (auto it = copies.begin(); it != copies.end();) {
+                if (it->second.isLocal() && static_cast<uint32_t>(-it->second.offset()) == local)
+                    it = copies.erase(it);
+                else
+                    ++it;
+            }
+        }
+
+        if (node.instruction->id != Move::ID)
+            continue;
+        auto& move = *reinterpret_cast<Move*>(node.instruction);
+        if (move.dst == move.src) {
+            remove(node);
+            changed = true;
+            continue;
+        }
+        if (!move.dst.isLocal() || !move.src.isLocal())
+            continue;
+
+        // The previous instruction may be a move this pass already folded away
+        const Node* previous = index && !isLeader[index] && !m_edits.count(nodes[index - 1].offset) ? &nodes[index - 1] : nullptr;
+        uint32_t src = -move.src.offset();
+        uint32_t dst = -move.dst.offset();
+        if (previous && !previous->target && previous->defs.size() == 1 && previous->defs[0] == src
+            && std::find(previous->uses.begin(), previous->uses.end(), dst) == previous->uses.end()
+            && !liveness.isLiveOut(index, src)) {
+            Liveness::forEachRegister(previous->instruction, [&](Register& reg, uint32_t, int32_t, bool isDef) {
+                if (isDef)
+                    reg = move.dst;
+            });
+            remove(node);
+            changed = true;
+            continue;
+        }
+
+        copies.emplace(dst, move.src);
+    }
+    return changed;
+}
+
+// Computing a value that's never read is only worth keeping if the instruction
+// has other effects
+bool BytecodeOptimizer::removeDeadStores()
+{
+    Liveness liveness = computeLiveness();
+    const std::vector<Node>& nodes = liveness.nodes();
+    bool changed = false;
+    for (uint32_t index = 0; index < nodes.size(); index++) {
+        const Node& node = nodes[index];
+        switch (node.instruction->id) {
+        case Move::ID:
+        case LoadConstant::ID:
+        case IsEqual::ID:
+        case IsCell::ID:
+            break;
+        default:
+            continue;
+        }
+
+        bool isDead = true;
+        for (uint32_t local : node.defs)
+            isDead = isDead && !liveness.isLiveOut(index, local);
+        if (isDead && !node.defs.empty()) {
+            remove(node);
+            changed = true;
+        }
+    }
+    return changed;
+}
+
+// Replaces pairs of instructions with the superinstruction that does both at
+// once, when nothing jumps in between and the temporary that connects them
+// isn't read anywhere else
+bool BytecodeOptimizer::fuseInstructions()
+{
+    Liveness liveness = computeLiveness();
+    const std::vector<Node>& nodes = liveness.nodes();
+    std::vector<bool> isLeader = leaders(liveness);
+
+#define FUSE(__Superinstruction) \
+    if (fuse<__Superinstruction>(liveness, index)) { \
+        changed = true; \
+        index++; \
+        continue; \
+    }
+
+    bool changed = false;
+    for (uint32_t index = 0; index + 1 < nodes.size(); index++) {
+        if (isLeader[index + 1])
+            continue;
+        FOR_EACH_SUPERINSTRUCTION(FUSE)
+    }
+    return changed;
+
+#undef FUSE
+}
+
+template<typename Superinstruction>
+bool BytecodeOptimizer::fuse(const Liveness& liveness, uint32_t index)
+{
+    using First = typename Superinstruction::First;
+    using Second = typename Superinstruction::Second;
+
+    const Node& first = liveness.nodes()[index];
+    const Node& second = liveness.nodes()[index + 1];
+    if (first.instruction->id != First::ID || second.instruction->id != Second::ID)
+        return false;
+    if (first.target || first.defs.size() != 1)
+        return false;
+    const First& firstInstruction = *reinterpret_cast<const First*>(first.instruction);
+    const Second& secondInstruction = *reinterpret_cast<const Second*>(second.instruction);
+    if (!Superinstruction::canFuse(firstInstruction, secondInstruction))
+        return false;
+
+    uint32_t temporary = first.defs[0];
+    if (std::count(second.uses.begin(), second.uses.end(), temporary) != 1)
+        return false;
+    // Unless the second instruction overwrites it anyway
+    bool isOverwritten = !second.target && std::count(second.defs.begin(), second.defs.end(), temporary);
+    if (liveness.isLiveOut(index + 1, temporary) && !isOverwritten)
+        return false;
+
+    InstructionWords instruction;
+    Superinstruction::emit(&instruction, firstInstruction, secondInstruction);
+    m_edits[first.offset] = std::move(instruction.words);
+    remove(second);
+    return true;
+}
+
+std::vector<bool> BytecodeOptimizer::leaders(const Liveness& liveness) const
+{
+    const std::vector<Node>& nodes = liveness.nodes();
+    std::vector<bool> isLeader(nodes.size());
+    for (uint32_t index = 0; index < nodes.size(); index++) {
+        const Node& node = nodes[index];
+        if (!index || !nodes[index - 1].next || nodes[index - 1].target || node.instruction->id == Enter::ID)
+            isLeader[index] = true;
+        if (node.target)
+            isLeader[*node.target] = true;
+    }
+    return isLeader;
+}
+
+InstructionStream& BytecodeOptimizer::instructions()
+{
+    return m_block.instructions(m_code);
+}
+
+Liveness BytecodeOptimizer::computeLiveness()
+{
+    return Liveness { instructions(), m_block.numLocals(m_code) };
+}
+
+uint32_t BytecodeOptimizer::constant(bool value)
+{
+    for (uint32_t index = 0; index < m_block.m_constants.size(); index++) {
+        Value constant = m_block.m_constants[index];
+        if (constant.isBool() && constant.asBool() == value)
+            return index;
+    }
+
+    Heap::WriteBarrier barrier(&m_block);
+    m_block.m_constants.push_back(value);
+    return m_block.m_constants.size() - 1;
+}
+
+void BytecodeOptimizer::remove(const Node& node)
+{
+    m_edits[node.offset] = { };
+}
+
+template<typename Instruction, typename... Args>
+void BytecodeOptimizer::replace(const Node& node, Args... args)
+{
+    InstructionWords instruction;
+    Instruction::emit(&instruction, args...);
+    m_edits[node.offset] = std::move(instruction.words);
+}
+
+bool BytecodeOptimizer::compact()
+{
+    if (m_edits.empty())
+        return false;
+
+    InstructionStream& instructions = this->instructions();
+    std::vector<uint32_t>& oldWords = instructions.m_instructions;
+    std::vector<uint32_t> words;
+    // Offsets in the compacted stream, for every offset in the original one.
+    // Removed instructions map to whatever follows them.
+    std::vector<InstructionStream::Offset> newOffsets(oldWords.size() + 1);
+    // Original offsets of the instructions that are left
+    std::vector<InstructionStream::Offset> oldOffsets;
+    for (auto instruction = instructions.begin(); instruction != instructions.end(); ++instruction) {
+        InstructionStream::Offset offset = instruction.offset();
+        for (size_t i = 0; i < instruction->size(); i++)
+            newOffsets[offset + i] = words.size();
+
+        auto edit = m_edits.find(offset);
+        if (edit == m_edits.end())
+            words.insert(words.end(), oldWords.begin() + offset, oldWords.begin() + offset + instruction->size());
+        else if (!edit->second.empty())
+            words.insert(words.end(), edit->second.begin(), edit->second.end());
+        else
+            continue;
+        oldOffsets.push_back(offset);
+    }
+    newOffsets[oldWords.size()] = words.size();
+
+    InstructionStream::Offset newOffset = 0;
+    for (InstructionStream::Offset oldOffset : oldOffsets) {
+        Instruction* instruction = reinterpret_cast<Instruction*>(&words[newOffset]);
+        if (int32_t* target = Liveness::jumpTarget(instruction))
+            *target = newOffsets[oldOffset + *target] - newOffset;
+        newOffset += instruction->size();
+    }
+
+    for (LocationInfo& info : m_block.stream(m_code).locationInfos)
+        info.bytecodeOffset = newOffsets[std::min<size_t>(info.bytecodeOffset, oldWords.size())];
+
+    oldWords.swap(words);
+    instructions.m_iterator = oldWords.end();
+    m_edits.clear();
+    return true;
+}
@@ -0,0 +1,52 @@
+#pragma once
+
+#include "BytecodeBlock.h"
+#include "Liveness.h"
+#include <iostream>
+#include <map>
+#include <vector>
+
+// Cleans up one stream of the bytecode of a block once it's complete, before it
+// first runs. Passes record their edits, which are then applied by compacting
+// the instruction stream: jump targets and location info are moved along with
+// the instructions.
+class BytecodeOptimizer {
+public:
+    BytecodeOptimizer(BytecodeBlock&, BytecodeBlock::Code);
+
+    // Runs the passes until none of them finds anything left to do, then fuses
+    // pairs of instructions into superinstructions. If `stats` is given, the
+    // instructions removed by each pass are reported to it.
+    void optimize(std::ostream* stats = nullptr);
+
+private:
+    using Node = Liveness::Node;
+
+    bool threadJumps();
+    bool removeUnreachableCode();
+    bool foldConstants();
+    bool propagateCopies();
+    bool removeDeadStores();
+    bool fuseInstructions();
+
+    template<typename Superinstruction>
+    bool fuse(const Liveness&, uint32_t);
+
+    void remove(const Node&);
+    template<typename Instruction, typename... Args>
+    void replace(const Node&, Args...);
+    bool compact();
+
+    InstructionStream& instructions();
+    Liveness computeLiveness();
+
+    // Whether each node starts a basic block
+    std::vector<bool> leaders(const Liveness&) const;
+    uint32_t constant(bool);
+
+    BytecodeBlock& m_block;
+    BytecodeBlock::Code m_code;
+    // The words that replace the instruction at each offset, or nothing to
+    // remove it. Jump targets are relative to the original offset.
+    std::map<InstructionStream::Offset, std::vector<uint32_t>> m_edits;
+};
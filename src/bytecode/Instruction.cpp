@@ -2,11 +2,16 @@
 
 #include "Instructions.h"
 
-const char* Instruction::name() const
+const char* Instruction::name(ID id)
 {
   return names[id];
 }
 
+const char* Instruction::name() const
+{
+  return name(id);
+}
+
 size_t Instruction::size() const
 {
   return sizes[id];
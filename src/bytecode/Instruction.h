@@ -16,6 +16,8 @@ private:
     static constexpr size_t sizes[] = { INSTRUCTION_SIZES };
 
 public:
+    static const char* name(ID);
+
     const char* name() const;
     size_t size() const;
     void dump(std::ostream&) const;
@@ -102,6 +102,12 @@ void InstructionStream::emit(uint32_t word)
     ++m_iterator;
 }
 
+void InstructionStream::clear()
+{
+    std::vector<uint32_t>().swap(m_instructions);
+    m_iterator = m_instructions.end();
+}
+
 void InstructionStream::emitPrologue(const std::function<void()>& functor)
 {
     m_iterator = m_instructions.begin() + 1; // after Enter
@@ -9,6 +9,8 @@
 
 class InstructionStream {
     friend class BytecodeGenerator;
+    friend class BytecodeOptimizer;
+    friend class Liveness;
     friend class WritableRef;
 
 public:
@@ -57,6 +59,7 @@ public:
     Ref end() const;
 
     size_t size() const { return m_instructions.size(); }
+    void clear();
 
     template<typename JumpType, typename Label>
     void recordJump(uint32_t prologueSize, Label& label)
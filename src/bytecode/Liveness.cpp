@@ -0,0 +1,93 @@
+#include "Liveness.h"
+
+Liveness::Liveness(InstructionStream& instructions, uint32_t numLocals)
+{
+    buildGraph(instructions, numLocals);
+    computeLiveness(numLocals);
+}
+
+int32_t* Liveness::jumpTarget(Instruction* instruction)
+{
+    switch (instruction->id) {
+    case Jump::ID:
+        return &reinterpret_cast<Jump*>(instruction)->target;
+    case JumpIfFalse::ID:
+        return &reinterpret_cast<JumpIfFalse*>(instruction)->target;
+    case TryGetField::ID:
+        return &reinterpret_cast<TryGetField*>(instruction)->target;
+    case JumpIfNotEqual::ID:
+        return &reinterpret_cast<JumpIfNotEqual*>(instruction)->target;
+    case JumpIfNotCellKind::ID:
+        return &reinterpret_cast<JumpIfNotCellKind*>(instruction)->target;
+    default:
+        return nullptr;
+    }
+}
+
+void Liveness::buildGraph(InstructionStream& instructions, uint32_t numLocals)
+{
+    std::vector<uint32_t> nodeAtOffset(instructions.size());
+    for (auto instruction = instructions.begin(); instruction != instructions.end(); ++instruction) {
+        nodeAtOffset[instruction.offset()] = m_nodes.size();
+        m_nodes.push_back(Node { reinterpret_cast<Instruction*>(&instructions.m_instructions[instruction.offset()]), instruction.offset(), { }, { }, { }, { } });
+    }
+
+    for (uint32_t index = 0; index < m_nodes.size(); index++) {
+        Node& node = m_nodes[index];
+        Instruction::ID id = node.instruction->id;
+        // RuntimeError never returns
+        if (id != Jump::ID && id != End::ID && id != RuntimeError::ID && index + 1 < m_nodes.size())
+            node.next = index + 1;
+        if (int32_t* target = jumpTarget(node.instruction))
+            node.target = nodeAtOffset[node.offset + *target];
+
+        forEachRegister(node.instruction, [&](Register& reg, uint32_t count, int32_t step, bool isDef) {
+            forEachLocal(reg, count, step, [&](uint32_t local) {
+                ASSERT(local <= numLocals, "Local out of bounds: %u", local);
+                (isDef ? node.defs : node.uses).push_back(local);
+            });
+        });
+    }
+}
+
+void Liveness::computeLiveness(uint32_t numLocals)
+{
+    size_t words = numLocals / 64 + 1;
+    std::vector<Bits> liveIn(m_nodes.size(), Bits(words));
+    m_liveOut.assign(m_nodes.size(), Bits(words));
+
+    Bits in(words);
+    for (bool changed = true; changed;) {
+        changed = false;
+        for (size_t index = m_nodes.size(); index--;) {
+            const Node& node = m_nodes[index];
+            Bits& out = m_liveOut[index];
+            std::fill(out.begin(), out.end(), 0);
+            std::fill(in.begin(), in.end(), 0);
+
+            // Instructions that can jump only write their operands when they fall through
+            if (node.next) {
+                const Bits& successor = liveIn[*node.next];
+                for (size_t i = 0; i < words; i++)
+                    out[i] |= successor[i];
+                in = out;
+                for (uint32_t local : node.defs)
+                    in[local / 64] &= ~(1ull << (local % 64));
+            }
+            if (node.target) {
+                const Bits& successor = liveIn[*node.target];
+                for (size_t i = 0; i < words; i++) {
+                    out[i] |= successor[i];
+                    in[i] |= successor[i];
+                }
+            }
+            for (uint32_t local : node.uses)
+                in[local / 64] |= 1ull << (local % 64);
+
+            if (in != liveIn[index]) {
+                liveIn[index] = in;
+                changed = true;
+            }
+        }
+    }
+}
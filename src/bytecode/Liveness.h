@@ -0,0 +1,75 @@
+#pragma once
+
+#include "InstructionStream.h"
+#include "Instructions.h"
+#include <optional>
+#include <stdint.h>
+#include <vector>
+
+// The control flow graph of a stream of instructions, with one node per instruction, and the
+// locals that are live after each of them, i.e. that might be read before
+// being written again. Locals are identified by their number, as passed to
+// Register::forLocal.
+class Liveness {
+public:
+    using Bits = std::vector<uint64_t>;
+
+    struct Node {
+        Instruction* instruction;
+        InstructionStream::Offset offset;
+        std::optional<uint32_t> next;
+        std::optional<uint32_t> target;
+        std::vector<uint32_t> uses;
+        std::vector<uint32_t> defs;
+    };
+
+    Liveness(InstructionStream&, uint32_t numLocals);
+
+    const std::vector<Node>& nodes() const { return m_nodes; }
+    const Bits& liveOut(uint32_t node) const { return m_liveOut[node]; }
+    bool isLiveOut(uint32_t node, uint32_t local) const { return m_liveOut[node][local / 64] & (1ull << (local % 64)); }
+
+    // Calls `functor(Register&, uint32_t count, int32_t step, bool isDef)` for
+    // every register operand of `instruction`
+    template<typename Functor>
+    static void forEachRegister(Instruction*, const Functor&);
+
+    // Calls `functor` with the number of every local in a register operand
+    template<typename Functor>
+    static void forEachLocal(Register, uint32_t count, int32_t step, const Functor&);
+
+    // The target field of instructions that can jump, or nullptr
+    static int32_t* jumpTarget(Instruction*);
+
+private:
+    void buildGraph(InstructionStream&, uint32_t numLocals);
+    void computeLiveness(uint32_t numLocals);
+
+    std::vector<Node> m_nodes;
+    std::vector<Bits> m_liveOut;
+};
+
+template<typename Functor>
+void Liveness::forEachRegister(Instruction* instruction, const Functor& functor)
+{
+#define CASE(__Instruction) \
+    case __Instruction::ID: \
+        reinterpret_cast<struct __Instruction*>(instruction)->forEachRegister(functor); \
+        break;
+
+    switch (instruction->id) {
+    FOR_EACH_INSTRUCTION(CASE)
+    }
+
+#undef CASE
+}
+
+template<typename Functor>
+void Liveness::forEachLocal(Register reg, uint32_t count, int32_t step, const Functor& functor)
+{
+    if (!reg.isLocal())
+        return;
+    uint32_t first = -reg.offset();
+    for (uint32_t i = 0; i < count; i++)
+        functor(first - i * step);
+}
@@ -19,6 +19,7 @@ struct LocationInfoWithFile {
     }
 
     const char* filename;
-    const LocationInfo& info;
+    // A copy, since type errors are reported after the code they come from is released
+    LocationInfo info;
 };
 
@@ -18,7 +18,7 @@ Register Register::invalid()
     return Register { s_invalidOffset };
 }
 
-bool Register::operator==(Register other)
+bool Register::operator==(Register other) const
 {
     return m_offset == other.m_offset;
 }
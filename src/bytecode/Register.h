@@ -18,7 +18,7 @@ public:
   bool isLocal() const { return m_offset < 0; }
   bool isValid() const { return m_offset != s_invalidOffset; }
 
-  bool operator==(Register);
+  bool operator==(Register) const;
 
   void dump(std::ostream& out, unsigned = 0) const
   {
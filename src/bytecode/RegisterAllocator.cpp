@@ -0,0 +1,188 @@
+#include "RegisterAllocator.h"
+
+#include "BytecodeBlock.h"
+#include "Log.h"
+#include <algorithm>
+
+static bool intersects(const std::vector<uint64_t>& lhs, const std::vector<uint64_t>& rhs)
+{
+    for (size_t i = 0; i < lhs.size(); i++) {
+        if (lhs[i] & rhs[i])
+            return true;
+    }
+    return false;
+}
+
+RegisterAllocator::RegisterAllocator(BytecodeBlock& block, BytecodeBlock::Code code)
+    : m_block(block)
+    , m_code(code)
+    , m_numLocals(block.numLocals(code))
+    , m_pinnedLocal(-block.environmentRegister().offset())
+{
+}
+
+void RegisterAllocator::allocate()
+{
+    Liveness liveness { m_block.instructions(m_code), m_numLocals };
+    if (!collectUnits(liveness))
+        return;
+    computeOccupancy(liveness);
+    assignSlots();
+    rewrite(liveness);
+}
+
+bool RegisterAllocator::isAllocatable(uint32_t local) const
+{
+    ASSERT(local && local <= m_numLocals, "Local out of bounds: %u", local);
+    // The JIT keeps the environment in its own local
+    return local != m_pinnedLocal;
+}
+
+// Locals in the same range operand have to stay next to each other, so every
+// group of overlapping ranges is allocated as a single unit. Everything else
+// gets a unit of its own.
+bool RegisterAllocator::collectUnits(const Liveness& liveness)
+{
+    std::vector<std::pair<uint32_t, uint32_t>> ranges;
+    for (const Liveness::Node& node : liveness.nodes()) {
+        Liveness::forEachRegister(node.instruction, [&](Register& reg, uint32_t count, int32_t step, bool) {
+            if (count < 2 || !reg.isLocal())
+                return;
+            uint32_t first = -reg.offset();
+            uint32_t last = first - (count - 1) * step;
+            ranges.emplace_back(std::min(first, last), std::max(first, last));
+        });
+    }
+    std::sort(ranges.begin(), ranges.end());
+
+    std::vector<bool> isInUnit(m_numLocals + 1);
+    for (size_t i = 0; i < ranges.size();) {
+        uint32_t low = ranges[i].first;
+        uint32_t high = ranges[i].second;
+        for (++i; i < ranges.size() && ranges[i].first <= high; ++i)
+            high = std::max(high, ranges[i].second);
+        if (low <= m_pinnedLocal && m_pinnedLocal <= high)
+            return false;
+
+        Unit unit { { }, 0 };
+        for (uint32_t local = low; local <= high; local++) {
+            unit.locals.push_back(local);
+            isInUnit[local] = true;
+        }
+        m_units.push_back(std::move(unit));
+    }
+
+    for (const Liveness::Node& node : liveness.nodes()) {
+        for (const auto* locals : { &node.uses, &node.defs }) {
+            for (uint32_t local : *locals) {
+                if (!isAllocatable(local) || isInUnit[local])
+                    continue;
+                m_units.push_back(Unit { { local }, 0 });
+                isInUnit[local] = true;
+            }
+        }
+    }
+    return true;
+}
+
+// Two locals can share a slot unless there's an instruction during which both
+// hold a value: where both are live, or where one is written while the other
+// is live. Operands of the same instruction never share a slot either, since
+// handlers may write their results before they are done reading.
+void RegisterAllocator::computeOccupancy(const Liveness& liveness)
+{
+    m_nodeCount = liveness.nodes().size();
+    size_t words = m_nodeCount / 64 + 1;
+    m_occupancy.assign(m_numLocals + 1, Bits(words));
+
+    for (size_t index = 0; index < m_nodeCount; index++) {
+        const Liveness::Node& node = liveness.nodes()[index];
+        uint64_t bit = 1ull << (index % 64);
+        const Bits& live = liveness.liveOut(index);
+        for (size_t i = 0; i < live.size(); i++) {
+            for (uint64_t bits = live[i]; bits; bits &= bits - 1)
+                m_occupancy[i * 64 + __builtin_ctzll(bits)][index / 64] |= bit;
+        }
+        for (const auto* locals : { &node.uses, &node.defs }) {
+            for (uint32_t local : *locals)
+                m_occupancy[local][index / 64] |= bit;
+        }
+
+        // Locals that are read before being written expect the value Enter
+        // initialized them with, so they can't share their slot.
+        if (node.instruction->id == Enter::ID) {
+            for (size_t i = 0; i < live.size(); i++) {
+                for (uint64_t bits = live[i]; bits; bits &= bits - 1)
+                    std::fill(m_occupancy[i * 64 + __builtin_ctzll(bits)].begin(), m_occupancy[i * 64 + __builtin_ctzll(bits)].end(), ~0ull);
+            }
+        }
+    }
+}
+
+bool RegisterAllocator::fits(uint32_t local, uint32_t slot) const
+{
+    return slot >= m_slotOccupancy.size() || !intersects(m_occupancy[local], m_slotOccupancy[slot]);
+}
+
+// Greedily give each unit the lowest slots that are free for all its locals,
+// in the order in which they're first used
+void RegisterAllocator::assignSlots()
+{
+    for (Unit& unit : m_units) {
+        unit.firstUse = m_nodeCount;
+        for (uint32_t local : unit.locals) {
+            const Bits& occupancy = m_occupancy[local];
+            for (size_t i = 0; i < occupancy.size(); i++) {
+                if (occupancy[i]) {
+                    unit.firstUse = std::min<uint32_t>(unit.firstUse, i * 64 + __builtin_ctzll(occupancy[i]));
+                    break;
+                }
+            }
+        }
+    }
+    std::stable_sort(m_units.begin(), m_units.end(), [](const Unit& lhs, const Unit& rhs) {
+        return lhs.firstUse < rhs.firstUse;
+    });
+
+    size_t words = m_nodeCount / 64 + 1;
+    m_slots.assign(m_numLocals + 1, 0);
+    m_slotOccupancy.assign(m_pinnedLocal + 1, Bits(words));
+    std::fill(m_slotOccupancy[m_pinnedLocal].begin(), m_slotOccupancy[m_pinnedLocal].end(), ~0ull);
+
+    for (const Unit& unit : m_units) {
+        uint32_t base = 1;
+        for (;; base++) {
+            bool fitsAll = true;
+            for (uint32_t i = 0; fitsAll && i < unit.locals.size(); i++)
+                fitsAll = fits(unit.locals[i], base + i);
+            if (fitsAll)
+                break;
+        }
+
+        for (uint32_t i = 0; i < unit.locals.size(); i++) {
+            uint32_t local = unit.locals[i];
+            uint32_t slot = base + i;
+            if (slot >= m_slotOccupancy.size())
+                m_slotOccupancy.resize(slot + 1, Bits(words));
+            Bits& slotOccupancy = m_slotOccupancy[slot];
+            for (size_t j = 0; j < words; j++)
+                slotOccupancy[j] |= m_occupancy[local][j];
+            m_slots[local] = slot;
+        }
+    }
+}
+
+void RegisterAllocator::rewrite(const Liveness& liveness)
+{
+    for (const Liveness::Node& node : liveness.nodes()) {
+        Liveness::forEachRegister(node.instruction, [&](Register& reg, uint32_t count, int32_t, bool) {
+            if (!count || !reg.isLocal() || !isAllocatable(-reg.offset()))
+                return;
+            reg = Register::forLocal(m_slots[-reg.offset()]);
+        });
+    }
+
+    uint32_t numLocals = m_slotOccupancy.size() - 1;
+    LOG(RegisterAllocation, m_block.name() << ": " << m_numLocals << " locals, down to " << numLocals);
+    m_block.stream(m_code).numLocals = numLocals;
+}
@@ -0,0 +1,48 @@
+#pragma once
+
+#include "BytecodeBlock.h"
+#include "Liveness.h"
+#include <stdint.h>
+#include <vector>
+
+// Renumbers the locals of one stream of a block once it's complete, so that
+// locals that are never live at the same time share a slot. The bytecode
+// generator hands out a fresh local for every temporary, and every slot of the
+// frame has to be initialized on entry and scanned by the GC.
+class RegisterAllocator {
+public:
+    RegisterAllocator(BytecodeBlock&, BytecodeBlock::Code);
+
+    void allocate();
+
+private:
+    using Bits = Liveness::Bits;
+
+    struct Unit {
+        // Locals that must keep their relative position, e.g. the arguments
+        // of a call, indexed by their distance to the lowest numbered one
+        std::vector<uint32_t> locals;
+        uint32_t firstUse;
+    };
+
+    bool collectUnits(const Liveness&);
+    void computeOccupancy(const Liveness&);
+    void assignSlots();
+    void rewrite(const Liveness&);
+
+    bool isAllocatable(uint32_t) const;
+    bool fits(uint32_t local, uint32_t slot) const;
+
+    BytecodeBlock& m_block;
+    BytecodeBlock::Code m_code;
+    uint32_t m_numLocals;
+    uint32_t m_pinnedLocal;
+    size_t m_nodeCount { 0 };
+
+    std::vector<Unit> m_units;
+    // Per local: the instructions during which its slot holds a value, one bit per instruction
+    std::vector<Bits> m_occupancy;
+    // Per slot: the union of the occupancy of the locals assigned to it
+    std::vector<Bits> m_slotOccupancy;
+    std::vector<uint32_t> m_slots;
+};
@@ -5,7 +5,7 @@ import "Type.h"
 instruction :Enter
 
 instruction :End,
-    dst: :Register
+    value: :Register
 
 instruction :Move,
     dst: :Register,
@@ -15,23 +15,48 @@ instruction :LoadConstant,
     dst: :Register,
     constantIndex: :uint32_t
 
-instruction :StoreConstant,
-    constantIndex: :uint32_t,
-    value: :Register
+type_checking do
+  instruction :StoreConstant,
+      constantIndex: :uint32_t,
+      value: :Register
+end
 
 instruction :GetLocal,
     dst: :Register,
     identifierIndex: :uint32_t
 
-instruction :GetLocalOrConstant,
+# Reads a binding of the global environment from its cell in the VM, and only
+# looks the identifier up once another environment binds the same name.
+instruction :GetGlobal,
     dst: :Register,
-    identifierIndex: :uint32_t,
-    constantIndex: :uint32_t
+    cellIndex: :uint32_t,
+    identifierIndex: :uint32_t
+
+type_checking do
+  instruction :GetLocalOrConstant,
+      dst: :Register,
+      identifierIndex: :uint32_t,
+      constantIndex: :uint32_t
+end
 
 instruction :SetLocal,
     identifierIndex: :uint32_t,
     src: :Register
 
+# Each closure copies the variables of enclosing functions it uses to the slots
+# of its own environment. Its code reads them `depth` environments up, and only
+# looks the identifier up if that environment binds names instead.
+instruction :GetCapturedVariable,
+    dst: :Register,
+    depth: :uint32_t,
+    slot: :uint32_t,
+    identifierIndex: :uint32_t
+
+instruction :SetCapturedVariable,
+    function: :Register,
+    slot: :uint32_t,
+    src: :Register
+
 instruction :NewArray,
     dst: :Register,
     type: :Register,
@@ -47,9 +72,11 @@ instruction :GetArrayIndex,
     array: :Register,
     index: :Register
 
-instruction :GetArrayLength,
-    dst: :Register,
-    array: :Register
+type_checking do
+  instruction :GetArrayLength,
+      dst: :Register,
+      array: :Register
+end
 
 instruction :NewTuple,
     dst: :Register,
@@ -70,31 +97,47 @@ instruction :NewFunction,
     dst: :Register,
     functionIndex: :uint32_t
 
+# The arguments are in `argc` consecutive registers, at increasing addresses
+# starting from `firstArg`
 instruction :Call,
     dst: :Register,
     callee: :Register,
     argc: :uint32_t,
-    firstArg: :Register
+    firstArg: registers_up(:argc)
+
+# Same as Call, but the result is returned right away, so the callee can reuse
+# the caller's frame. The interpreter always does; JIT code only when the
+# callee is the caller's own block.
+instruction :TailCall,
+    dst: :Register,
+    callee: :Register,
+    argc: :uint32_t,
+    firstArg: registers_up(:argc)
 
 instruction :NewObject,
     dst: :Register,
     type: :Register,
     inlineSize: :uint32_t
 
+# Fields are looked up by name, then through the block's FieldCache at
+# `cacheIndex` for as long as the object has the same shape as the last one.
 instruction :SetField,
     object: :Register,
     fieldIndex: :uint32_t,
-    value: :Register
+    value: :Register,
+    cacheIndex: :uint32_t
 
 instruction :GetField,
     dst: :Register,
     object: :Register,
-    fieldIndex: :uint32_t
+    fieldIndex: :uint32_t,
+    cacheIndex: :uint32_t
 
 instruction :TryGetField,
     dst: :Register,
     object: :Register,
     fieldIndex: :uint32_t,
+    cacheIndex: :uint32_t,
     target: :int32_t
 
 instruction :Jump,
@@ -117,44 +160,70 @@ instruction :IsCell,
     value: :Register,
     kind: "Cell::Kind"
 
-# Type checking instructions
-instruction :PushScope
+# Operators on numbers, see NumericOperators.h. `callee` holds whatever the
+# operator's name refers to, which is called with `lhs` and `rhs` unless it's
+# the VM's own operator and both are numbers.
+[:Add, :Sub, :Mul, :Div, :Mod, :Less, :LessEqual, :Greater, :GreaterEqual, :Equal, :NotEqual].each do |name|
+  instruction name,
+      dst: :Register,
+      callee: :Register,
+      lhs: :Register,
+      rhs: :Register
+end
 
-instruction :PopScope
+# Superinstructions, for pairs that the interpreter often dispatches back to
+# back, as reported by --profile-instruction-pairs. The optimizer fuses them
+# when the temporary isn't read anywhere else.
+superinstruction :GetLocalField, :GetLocal, :GetField, via: [:dst, :object]
 
-instruction :PushUnificationScope
+superinstruction :SetFieldToConstant, :LoadConstant, :SetField, via: [:dst, :value]
 
-instruction :PopUnificationScope
+superinstruction :NewObjectOfConstantType, :LoadConstant, :NewObject, via: [:dst, :type]
 
-instruction :Unify,
-    lhs: :Register,
-    rhs: :Register
+superinstruction :JumpIfNotEqual, :IsEqual, :JumpIfFalse, via: [:dst, :condition]
 
-instruction :Match,
-    lhs: :Register,
-    rhs: :Register
+superinstruction :JumpIfNotCellKind, :IsCell, :JumpIfFalse, via: [:dst, :condition]
 
-instruction :ResolveType,
-    dst: :Register,
-    type: :Register
+# Type checking instructions, only emitted before endTypeChecking
+type_checking do
+  instruction :PushScope
 
-instruction :CheckType,
-    dst: :Register,
-    type: :Register,
-    expected: "Type::Class"
+  instruction :PopScope
 
-instruction :CheckTypeOf,
-    dst: :Register,
-    type: :Register,
-    expected: "Type::Class"
+  instruction :PushUnificationScope
 
-instruction :TypeError,
-    messageIndex: :uint32_t
+  instruction :PopUnificationScope
 
-instruction :InferImplicitParameters,
-    function: :Register,
-    parameterCount: :uint32_t,
-    firstParameter: :Register
+  instruction :Unify,
+      lhs: :Register,
+      rhs: :Register
+
+  instruction :Match,
+      lhs: :Register,
+      rhs: :Register
+
+  instruction :ResolveType,
+      dst: :Register,
+      type: :Register
+
+  instruction :CheckType,
+      dst: :Register,
+      type: :Register,
+      expected: "Type::Class"
+
+  instruction :CheckTypeOf,
+      dst: :Register,
+      type: :Register,
+      expected: "Type::Class"
+
+  instruction :TypeError,
+      messageIndex: :uint32_t
+
+  instruction :InferImplicitParameters,
+      function: :Register,
+      parameterCount: :uint32_t,
+      firstParameter: registers_down(:parameterCount, defines: true)
+end
 
 # Create new types
 instruction :NewVarType,
@@ -179,13 +248,13 @@ instruction :NewTupleType,
 instruction :NewRecordType,
     dst: :Register,
     fieldCount: :uint32_t,
-    firstKey: :Register,
-    firstType: :Register
+    firstKey: registers_down(:fieldCount),
+    firstType: registers_down(:fieldCount)
 
 instruction :NewFunctionType,
     dst: :Register,
     paramCount: :uint32_t,
-    firstParam: :Register,
+    firstParam: registers_down(:paramCount),
     returnType: :Register,
     inferredParameters: :uint32_t
 
@@ -205,7 +274,7 @@ instruction :NewCallHole,
     dst: :Register,
     callee: :Register,
     argc: :uint32_t,
-    firstArg: :Register
+    firstArg: registers_up(:argc)
 
 instruction :NewSubscriptHole,
     dst: :Register,
@@ -218,10 +287,12 @@ instruction :NewMemberHole,
     fieldIndex: :uint32_t
 
 # Create new values from types
-instruction :NewValue,
-    dst: :Register,
-    type: :Register
-
-instruction :GetTypeForValue,
-    dst: :Register,
-    value: :Register
+type_checking do
+  instruction :NewValue,
+      dst: :Register,
+      type: :Register
+
+  instruction :GetTypeForValue,
+      dst: :Register,
+      value: :Register
+end
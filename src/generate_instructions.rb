@@ -1,6 +1,17 @@
 $context = binding
 
-class Instruction < Struct.new(:name, :fields)
+# `count` consecutive registers starting from the one in the field, where
+# `count` names another field. `step` is the difference between the offsets of
+# two consecutive registers.
+class RegisterRange < Struct.new(:count, :step, :defines)
+  def to_s
+    "Register"
+  end
+end
+
+# Instructions that only appear in the type checking code of a block, which
+# the JIT never compiles
+class Instruction < Struct.new(:name, :fields, :type_checking)
   def cpp_struct
     <<-EOS
     struct #{name} : public Instruction {
@@ -10,7 +21,12 @@ class Instruction < Struct.new(:name, :fields)
       #{emit}
 
       #{dump}
+
+      #{for_each_register}
+
+      #{fusion}
     };
+    static_assert(sizeof(#{name}) == #{fields.size + 1} * sizeof(uint32_t));
     EOS
   end
 
@@ -40,6 +56,29 @@ class Instruction < Struct.new(:name, :fields)
       EOS
   end
 
+  # Registers named `dst` are written by the instruction, all others are read
+  def for_each_register
+    calls = fields.map do |name, type|
+      if type.is_a? RegisterRange
+        "__functor(#{name}, #{type.count}, #{type.step}, #{type.defines});"
+      elsif type == :Register
+        "__functor(#{name}, 1, 0, #{name == :dst});"
+      end
+    end.compact
+
+    <<-EOS
+    template<typename Functor>
+    void forEachRegister(const Functor& __functor)
+    {
+        #{calls.empty? ? 'UNUSED(__functor);' : calls.join("\n")}
+    }
+    EOS
+  end
+
+  # Only superinstructions know how they're made
+  def fusion
+  end
+
   def dump
     <<-EOS
     void dump(std::ostream& out) const
@@ -51,8 +90,60 @@ class Instruction < Struct.new(:name, :fields)
   end
 end
 
+# Two instructions fused into one, where the first only computes a temporary
+# for the second. `via` names the field of each that holds the temporary, which
+# the superinstruction doesn't have: its fields are the remaining fields of the
+# first instruction followed by those of the second.
+class Superinstruction < Instruction
+  attr_reader :first, :second, :via
+
+  def initialize(name, first, second, via)
+    @first = first
+    @second = second
+    @via = via
+
+    @first_fields = first.fields.reject { |name, _| name == via[0] }
+    second_fields = second.fields.reject { |name, _| name == via[1] }
+    collisions = @first_fields.keys & second_fields.keys
+    raise "#{name}: fields of #{first.name} and #{second.name} collide: #{collisions.join(", ")}" unless collisions.empty?
+
+    super(name, @first_fields.merge(second_fields), first.type_checking || second.type_checking)
+  end
+
+  # Jump targets are relative to the start of the instruction, and the
+  # superinstruction starts where the first instruction did
+  def fusion
+    args = fields.map do |name, type|
+      if @first_fields.key? name
+        "__first.#{name}"
+      elsif name == :target && type == :int32_t
+        "__second.target + static_cast<int32_t>(sizeof(First) / sizeof(uint32_t))"
+      else
+        "__second.#{name}"
+      end
+    end
+
+    <<-EOS
+    using First = struct #{first.name};
+    using Second = struct #{second.name};
+
+    static bool canFuse(const First& __first, const Second& __second)
+    {
+        return __first.#{via[0]} == __second.#{via[1]};
+    }
+
+    template<typename BytecodeGenerator>
+    static void emit(BytecodeGenerator* __generator, const First& __first, const Second& __second)
+    {
+        emit(#{["__generator", *args].join(", ")});
+    }
+    EOS
+  end
+end
+
 $includes = []
 $instructions = []
+$type_checking = false
 
 def import(name)
     if name.is_a? String
@@ -62,8 +153,32 @@ def import(name)
     end
 end
 
+# Registers at increasing addresses, i.e. decreasing local numbers
+def registers_up(count, defines: false)
+  RegisterRange.new(count, 1, defines)
+end
+
+# Registers at decreasing addresses, i.e. increasing local numbers
+def registers_down(count, defines: false)
+  RegisterRange.new(count, -1, defines)
+end
+
 def instruction(name, fields = {})
-  $instructions << Instruction.new(name.to_s, fields)
+  $instructions << Instruction.new(name.to_s, fields, $type_checking)
+end
+
+def type_checking
+  $type_checking = true
+  yield
+ensure
+  $type_checking = false
+end
+
+def superinstruction(name, first, second, via:)
+  find = lambda do |name|
+    $instructions.find { |i| i.name == name.to_s } or raise "#{name}: unknown instruction"
+  end
+  $instructions << Superinstruction.new(name.to_s, find.(first), find.(second), via)
 end
 
 def load_definitions(file)
@@ -89,6 +204,8 @@ def generate_macros(file)
   #{instruction_sizes}
   #{instruction_names}
   #{for_each_instruction}
+  #{for_each_runtime_instruction}
+  #{for_each_superinstruction}
   EOS
 end
 
@@ -123,6 +240,21 @@ def for_each_instruction
   EOS
 end
 
+def for_each_runtime_instruction
+  <<-EOS
+  #define FOR_EACH_RUNTIME_INSTRUCTION(macro) \\
+      #{$instructions.reject(&:type_checking).map { |i| "macro(#{i.name})" }.join("\\\n")}
+  EOS
+end
+
+def for_each_superinstruction
+  superinstructions = $instructions.select { |i| i.is_a? Superinstruction }
+  <<-EOS
+  #define FOR_EACH_SUPERINSTRUCTION(macro) \\
+      #{superinstructions.map { |i| "macro(#{i.name})" }.join("\\\n")}
+  EOS
+end
+
 load_definitions(ARGV[0])
 generate_instructions(ARGV[1])
 generate_macros(ARGV[2])
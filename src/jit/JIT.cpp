@@ -6,6 +6,7 @@
 #include "Function.h"
 #include "Hole.h"
 #include "Log.h"
+#include "NumericOperators.h"
 #include "Object.h"
 #include "Scope.h"
 #include "Tuple.h"
@@ -88,11 +89,14 @@ void* JIT::compile()
         emit##Instruction(*reinterpret_cast<const Instruction*>(instruction.get())); \
         break;
 
-    for (auto instruction = m_block.instructions().at(m_block.codeStart()); instruction != m_block.instructions().end(); ++instruction) {
+    // Only the code that runs the block: its type checking code is gone by now
+    for (auto instruction = m_block.instructions().begin(); instruction != m_block.instructions().end(); ++instruction) {
         m_bytecodeOffset = instruction.offset();
         m_bytecodeOffsetMapping.emplace(m_bytecodeOffset, m_buffer.size());
         switch (instruction->id) {
-            FOR_EACH_INSTRUCTION(CASE)
+            FOR_EACH_RUNTIME_INSTRUCTION(CASE)
+        default:
+            ASSERT_NOT_REACHED();
         }
     }
 
@@ -140,7 +144,7 @@ OP(Enter)
 
 OP(End)
 {
-    load(ip.dst, regR0);
+    load(ip.value, regR0);
     epilogue();
 }
 
@@ -156,12 +160,6 @@ OP(LoadConstant)
     store(regT0, ip.dst);
 }
 
-OP(StoreConstant)
-{
-    UNUSED(ip);
-    ASSERT(false, "StoreConstant should only be used during type checking, and type checking shouldn't JIT");
-}
-
 OP(GetLocal)
 {
     Label error = label();
@@ -177,17 +175,45 @@ OP(GetLocal)
 
     emitLabel(error);
     move(vm(), regA0);
-    move(m_bytecodeOffset, regA1);
-    move(&m_block.identifier(ip.identifierIndex), regA2);
+    move(&m_block, regA1);
+    move(m_bytecodeOffset, regA2);
+    move(&m_block.identifier(ip.identifierIndex), regA3);
     call(jitUnknownVariable);
 
     emitLabel(end);
 }
 
-OP(GetLocalOrConstant)
+OP(GetGlobal)
 {
-    UNUSED(ip);
-    ASSERT(false, "GetLocalOrConstant should only be used during type checking, and type checking shouldn't JIT");
+    Label slowPath = label();
+    Label error = label();
+    Label end = label();
+
+    move(&m_vm.globalCell(ip.cellIndex), regT0);
+    move(Offset { OFFSETOF(GlobalCell, value), regT0 }, regT0);
+    compare(regT0, Value::crash());
+    jumpIfEqual(slowPath);
+    store(regT0, ip.dst);
+    jump(end);
+
+    // Another environment binds the same name
+    emitLabel(slowPath);
+    load(m_block.environmentRegister(), regA0);
+    move(&m_block.identifier(ip.identifierIndex), regA1);
+    call(&jitEnvironmentGet);
+    store(regR0, ip.dst);
+    compare(regR0, Value::crash());
+    jumpIfEqual(error);
+    jump(end);
+
+    emitLabel(error);
+    move(vm(), regA0);
+    move(&m_block, regA1);
+    move(m_bytecodeOffset, regA2);
+    move(&m_block.identifier(ip.identifierIndex), regA3);
+    call(jitUnknownVariable);
+
+    emitLabel(end);
 }
 
 OP(SetLocal)
@@ -198,6 +224,52 @@ OP(SetLocal)
     call<Environment, void, const std::string&, Value>(&Environment::set);
 }
 
+OP(GetCapturedVariable)
+{
+    Label slowPath = label();
+    Label error = label();
+    Label end = label();
+
+    load(m_block.environmentRegister(), regT0);
+    for (uint32_t i = 0; i < ip.depth; i++)
+        move(Offset { OFFSETOF(Environment, m_parent), regT0 }, regT0);
+    move(Offset { OFFSETOF(Environment, m_slots), regT0 }, regT1);
+    compare(regT1, Value { nullptr });
+    jumpIfEqual(slowPath);
+    move(Offset { static_cast<int32_t>(ip.slot * sizeof(Value)), regT1 }, regT0);
+    store(regT0, ip.dst);
+    jump(end);
+
+    // The environment binds names instead, while type checking
+    emitLabel(slowPath);
+    load(m_block.environmentRegister(), regA0);
+    move(ip.depth, regA1);
+    move(ip.slot, regA2);
+    move(&m_block.identifier(ip.identifierIndex), regA3);
+    call(&jitGetCapturedVariable);
+    store(regR0, ip.dst);
+    compare(regR0, Value::crash());
+    jumpIfEqual(error);
+    jump(end);
+
+    emitLabel(error);
+    move(vm(), regA0);
+    move(&m_block, regA1);
+    move(m_bytecodeOffset, regA2);
+    move(&m_block.identifier(ip.identifierIndex), regA3);
+    call(jitUnknownVariable);
+
+    emitLabel(end);
+}
+
+OP(SetCapturedVariable)
+{
+    load(ip.function, regA0);
+    move(ip.slot, regA1);
+    load(ip.src, regA2);
+    call<Function, void, uint32_t, Value>(&Function::setCaptured);
+}
+
 OP(NewArray)
 {
     move(vm(), regA0);
@@ -223,12 +295,6 @@ OP(GetArrayIndex)
     store(regR0, ip.dst);
 }
 
-OP(GetArrayLength)
-{
-    UNUSED(ip);
-    ASSERT(false, "GetArrayLength is only used during type checking");
-}
-
 OP(NewTuple)
 {
     move(vm(), regA0);
@@ -257,11 +323,10 @@ OP(GetTupleIndex)
 OP(NewFunction)
 {
     move(m_block.function(ip.functionIndex), regA0);
-    load(m_block.environmentRegister(), regA1);
-    call<Function, void, Environment*>(&Function::setParentEnvironment);
-
-    move(m_block.function(ip.functionIndex), regT0);
-    store(regT0, ip.dst);
+    move(vm(), regA1);
+    load(m_block.environmentRegister(), regA2);
+    call<Function, Function*, VM&, Environment*>(&Function::createClosure);
+    store(regR0, ip.dst);
 }
 
 OP(Call)
@@ -270,10 +335,41 @@ OP(Call)
     load(ip.callee, regA1);
     move(ip.argc, regA2);
     lea(ip.firstArg, regA3);
-    call<Value, VM&, Function*, uint32_t, Value*>(&JIT::trampoline);
+    call<Value, VM&, Function*, uint32_t, const Value*>(&JIT::trampoline);
     store(regR0, ip.dst);
 }
 
+OP(TailCall)
+{
+    Label notSelf = label();
+
+    // A tail call back into this block reuses the frame: the arguments are
+    // copied over ours and we start over from the instruction after Enter
+    move(vm(), regA0);
+    load(ip.callee, regA1);
+    move(&m_block, regA2);
+    call(jitSelfTailCallEnvironment);
+    compare(regR0, Value { nullptr });
+    jumpIfEqual(notSelf);
+
+    store(regR0, m_block.environmentRegister());
+    uint32_t firstArgOffset = -ip.firstArg.offset();
+    for (uint32_t i = 0; i < ip.argc; i++) {
+        load(VirtualRegister::forLocal(firstArgOffset - i), regT0);
+        store(regT0, VirtualRegister::forParameter(i));
+    }
+    move(Value::crash(), regT0);
+    for (uint32_t i = 2; i <= m_block.numLocals(); i++)
+        store(regT0, regCFR, -static_cast<int32_t>(i));
+    jump(static_cast<int32_t>(sizeof(Enter) / sizeof(uint32_t)) - static_cast<int32_t>(m_bytecodeOffset));
+
+    // Anything else is a regular call, and the End that follows returns its result.
+    // JIT code runs on the native stack, so only self tail calls run in
+    // constant space: mutual recursion through tail calls grows it.
+    emitLabel(notSelf);
+    emitCall(reinterpret_cast<const Call&>(ip));
+}
+
 OP(NewObject)
 {
     move(vm(), regA0);
@@ -288,14 +384,14 @@ OP(SetField)
     load(ip.object, regA0);
     move(&m_block.identifier(ip.fieldIndex), regA1);
     load(ip.value, regA2);
+    move(&m_block.fieldCache(ip.cacheIndex), regA3);
     call(&Object::set);
 }
 
 OP(GetField)
 {
     load(ip.object, regA0);
-    move(&m_block.identifier(ip.fieldIndex), regA1);
-    call(&Object::get);
+    emitGetField(ip.fieldIndex, ip.cacheIndex);
     store(regR0, ip.dst);
 }
 
@@ -303,6 +399,7 @@ OP(TryGetField)
 {
     load(ip.object, regA0);
     move(&m_block.identifier(ip.fieldIndex), regA1);
+    move(&m_block.fieldCache(ip.cacheIndex), regA2);
     call(tryGetJIT);
     compare(regR0, Value::crash());
     jumpIfEqual(ip.target);
@@ -348,9 +445,10 @@ OP(IsEqual)
 OP(RuntimeError)
 {
     move(vm(), regA0);
-    move(m_bytecodeOffset, regA1);
-    move(&m_block.identifier(ip.messageIndex), regA2);
-    call(&VM::runtimeError);
+    move(&m_block, regA1);
+    move(m_bytecodeOffset, regA2);
+    move(&m_block.identifier(ip.messageIndex), regA3);
+    call<VM, void, const BytecodeBlock&, InstructionStream::Offset, const std::string&>(&VM::runtimeError);
 }
 
 OP(IsCell)
@@ -379,6 +477,228 @@ OP(IsCell)
     store(regT0, ip.dst);
 }
 
+// Reads the field of the object in regA0 into regR0: the slot recorded in the
+// cache if the object has the same shape, or whatever Object::get finds, which
+// updates the cache.
+void JIT::emitGetField(uint32_t fieldIndex, uint32_t cacheIndex)
+{
+    Label slowPath = label();
+    Label end = label();
+
+    move(&m_block.fieldCache(cacheIndex), regA2);
+    move(Offset { OFFSETOF(Object, m_shape), regA0 }, regT3);
+    move(Offset { OFFSETOF(FieldCache, shape), regA2 }, regT4);
+    compare(regT3, regT4);
+    jumpIfNotEqual(slowPath);
+    move(Offset { OFFSETOF(FieldCache, slot), regA2 }, regT3);
+    shiftl(3, regT3);
+    move(Offset { OFFSETOF(Object, m_slots), regA0 }, regT4);
+    add(regT4, regT3);
+    move(Offset { 0, regT3 }, regR0);
+    jump(end);
+
+    emitLabel(slowPath);
+    move(&m_block.identifier(fieldIndex), regA1);
+    call(&Object::get);
+
+    emitLabel(end);
+}
+
+// Operators on numbers: inline as long as the operator's name refers to the
+// VM's own function and both operands are numbers, which leaves them unboxed
+// in fpRegT0 and fpRegT1 for `operation`. That boxes the result into regT0,
+// or jumps to the slow path, which calls whatever the name refers to.
+template<typename Instruction, typename Functor>
+void JIT::emitNumericOperator(const Instruction& ip, Function* builtin, const Functor& operation)
+{
+    Label slowPath = label();
+    Label done = label();
+
+    load(ip.callee, regT0);
+    compare(regT0, Value { builtin });
+    jumpIfNotEqual(slowPath);
+
+    load(ip.lhs, regT1);
+    load(ip.rhs, regT2);
+    for (Register operand : { regT1, regT2 }) {
+        move(operand, regT0);
+        bitAnd(Value::TagTypeNumber, regT0);
+        compare(regT0, Value { nullptr });
+        jumpIfEqual(slowPath);
+        sub(Value::DoubleEncodeOffset, operand);
+    }
+    move(regT1, fpRegT0);
+    move(regT2, fpRegT1);
+
+    operation(slowPath);
+    store(regT0, ip.dst);
+    jump(done);
+
+    emitLabel(slowPath);
+    move(vm(), regA0);
+    load(ip.callee, regA1);
+    load(ip.lhs, regA2);
+    load(ip.rhs, regA3);
+    call(callOperator);
+    store(regR0, ip.dst);
+
+    emitLabel(done);
+}
+
+#define ARITHMETIC_OP(Instruction, emitOperation) \
+    OP(Instruction) \
+    { \
+        emitNumericOperator(ip, m_vm.builtin##Instruction, [&](Label& slowPath) { \
+            emitOperation; \
+            /* x86 produces NaNs that don't box, leave them to the slow path */ \
+            compareDouble(fpRegT0, fpRegT0); \
+            jumpIfUnordered(slowPath); \
+            move(fpRegT0, regT0); \
+            add(Value::DoubleEncodeOffset, regT0); \
+        }); \
+    }
+
+// The result is whether the flags set by comparing `lhs` to `rhs` match `condition`
+#define COMPARISON_OP(Instruction, lhs, rhs, setCondition) \
+    OP(Instruction) \
+    { \
+        emitNumericOperator(ip, m_vm.builtin##Instruction, [&](Label&) { \
+            compareDouble(lhs, rhs); \
+            move(Value { false }, regT0); \
+            setCondition(regT0); \
+            bitOr(Value::TagTypeBool, regT0); \
+        }); \
+    }
+
+ARITHMETIC_OP(Add, addDouble(fpRegT1, fpRegT0))
+ARITHMETIC_OP(Sub, subDouble(fpRegT1, fpRegT0))
+ARITHMETIC_OP(Mul, mulDouble(fpRegT1, fpRegT0))
+ARITHMETIC_OP(Div, divDouble(fpRegT1, fpRegT0))
+// fmod takes and returns its operands in xmm0 and xmm1
+ARITHMETIC_OP(Mod, call(static_cast<double(*)(double, double)>(std::fmod)))
+
+// Unordered comparisons set the carry flag, so they're never above
+COMPARISON_OP(Less, fpRegT1, fpRegT0, setAbove)
+COMPARISON_OP(LessEqual, fpRegT1, fpRegT0, setAboveOrEqual)
+COMPARISON_OP(Greater, fpRegT0, fpRegT1, setAbove)
+COMPARISON_OP(GreaterEqual, fpRegT0, fpRegT1, setAboveOrEqual)
+
+// Unordered comparisons set the zero flag too, so NaN skips the condition and
+// keeps the result it starts with
+#define EQUALITY_OP(Instruction, unorderedResult, setCondition) \
+    OP(Instruction) \
+    { \
+        emitNumericOperator(ip, m_vm.builtin##Instruction, [&](Label&) { \
+            Label done = label(); \
+            compareDouble(fpRegT0, fpRegT1); \
+            move(Value { unorderedResult }, regT0); \
+            jumpIfUnordered(done); \
+            setCondition(regT0); \
+            emitLabel(done); \
+            bitOr(Value::TagTypeBool, regT0); \
+        }); \
+    }
+
+EQUALITY_OP(Equal, false, setEqual)
+EQUALITY_OP(NotEqual, true, setNotEqual)
+
+#undef EQUALITY_OP
+
+#undef COMPARISON_OP
+#undef ARITHMETIC_OP
+
+// Superinstructions
+
+OP(GetLocalField)
+{
+    Label error = label();
+    Label getField = label();
+
+    load(m_block.environmentRegister(), regA0);
+    move(&m_block.identifier(ip.identifierIndex), regA1);
+    call(&jitEnvironmentGet);
+    compare(regR0, Value::crash());
+    jumpIfEqual(error);
+    jump(getField);
+
+    emitLabel(error);
+    move(vm(), regA0);
+    move(&m_block, regA1);
+    move(m_bytecodeOffset, regA2);
+    move(&m_block.identifier(ip.identifierIndex), regA3);
+    call(jitUnknownVariable);
+    move(Value::crash(), regR0);
+
+    emitLabel(getField);
+    move(regR0, regA0);
+    emitGetField(ip.fieldIndex, ip.cacheIndex);
+    store(regR0, ip.dst);
+}
+
+OP(SetFieldToConstant)
+{
+    load(ip.object, regA0);
+    move(&m_block.identifier(ip.fieldIndex), regA1);
+    move(m_block.constant(ip.constantIndex), regA2);
+    move(&m_block.fieldCache(ip.cacheIndex), regA3);
+    call(&Object::set);
+}
+
+OP(NewObjectOfConstantType)
+{
+    move(vm(), regA0);
+    move(m_block.constant(ip.constantIndex), regA1);
+    move(ip.inlineSize, regA2);
+    call<Object*, VM&, Type*, uint32_t>(createObject);
+    store(regR0, ip.dst);
+}
+
+OP(JumpIfNotEqual)
+{
+    Label fastPath = label();
+    Label doJump = label();
+
+    load(ip.lhs, regT0);
+    load(ip.rhs, regT1);
+    compare(regT0, regT1);
+    jumpIfEqual(fastPath);
+
+    lea(ip.lhs, regT0);
+    lea(ip.rhs, regT1);
+    call(&Value::operator==);
+    bitOr(Value::TagTypeBool, regR0);
+    jump(doJump);
+
+    emitLabel(fastPath);
+    move(Value { false }, regR0);
+    setEqual(regR0);
+
+    emitLabel(doJump);
+    compare(regR0, Value { false });
+    jumpIfEqual(ip.target);
+}
+
+OP(JumpIfNotCellKind)
+{
+    Label isCell = label();
+    Label isKind = label();
+
+    load(ip.value, regT0);
+    move(regT0, regT1);
+    bitAnd(Value::TagMask, regT0);
+    compare(regT0, Value { nullptr });
+    jumpIfEqual(isCell);
+    jump(ip.target);
+
+    emitLabel(isCell);
+    move(Offset { OFFSETOF(Cell, m_kind), regT1 }, regT0);
+    compare32(regT0, static_cast<uint32_t>(ip.kind));
+    jumpIfEqual(isKind);
+    jump(ip.target);
+
+    emitLabel(isKind);
+}
+
 // Types
 
 OP(NewVarType)
@@ -486,35 +806,11 @@ OP(NewMemberHole)
     store(regR0, ip.dst);
 }
 
-#define TYPE_OP(Instruction) \
-    OP(Instruction) { \
-        UNUSED(ip); \
-        ASSERT(false, "JIT should not be doing type checking"); \
-    }
-
-TYPE_OP(PushScope)
-TYPE_OP(PopScope)
-TYPE_OP(PushUnificationScope)
-TYPE_OP(PopUnificationScope)
-TYPE_OP(Unify)
-TYPE_OP(Match)
-TYPE_OP(ResolveType)
-TYPE_OP(CheckType)
-TYPE_OP(CheckTypeOf)
-TYPE_OP(TypeError)
-TYPE_OP(InferImplicitParameters)
-TYPE_OP(NewValue)
-TYPE_OP(GetTypeForValue)
-
-#undef TYPE_OP
 #undef OP
 
-Value JIT::trampoline(VM& vm, Function* function, uint32_t argc, Value* argv)
+Value JIT::trampoline(VM& vm, Function* function, uint32_t argc, const Value* argv)
 {
-    std::vector<Value> args(argc);
-    for (uint32_t i = 0; i < argc; ++i)
-        args[i] = argv[-static_cast<int32_t>(i)];
-    return function->call(vm, args);
+    return function->call(vm, argv, argc);
 }
 
 // HELPERS
@@ -524,16 +820,19 @@ void JIT::prologue()
     push(regCFR);
     move(regSP, regCFR);
 
-    push(regA0);
-    push(regA1);
+    if (m_block.needsEnvironment()) {
+        push(regA0);
+        push(regA1);
 
-    // Create a new environment
-    move(vm(), regA0);
-    move(regA2, regA1);
-    call<Environment*, VM&, Environment*>(createEnvironment);
+        // Create a new environment
+        move(vm(), regA0);
+        move(regA2, regA1);
+        call<Environment*, VM&, Environment*>(createEnvironment);
 
-    pop(regA1);
-    pop(regA0);
+        pop(regA1);
+        pop(regA0);
+    } else
+        move(regA2, regR0);
 
     // Copy arguments into stack
     shiftl(3, regA0);
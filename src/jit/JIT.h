@@ -17,6 +17,7 @@ class JIT {
 public:
     using VirtualRegister = ::Register;
     enum Register : uint8_t;
+    enum FPRegister : uint8_t;
 
     static void* compile(VM&, const BytecodeBlock&);
 
@@ -33,7 +34,7 @@ private:
     void* compile();
     Label label();
 
-    static Value trampoline(VM& vm, Function*, uint32_t argc, Value* argv);
+    static Value trampoline(VM& vm, Function*, uint32_t argc, const Value* argv);
 
     // HELPERS
     void prologue();
@@ -72,14 +73,26 @@ private:
     void move(Offset, Register);
     void move(Register, Offset);
     void move(uint64_t, Register);
+    void move(Register, FPRegister);
+    void move(FPRegister, Register);
     void lea(Offset, Register);
     void call(void*);
     void compare32(Register, uint32_t);
     void compare(Register, Value);
     void compare(Register, Register);
+    void compareDouble(FPRegister, FPRegister);
     void setEqual(Register dst);
+    void setNotEqual(Register dst);
+    void setAbove(Register dst);
+    void setAboveOrEqual(Register dst);
+    void add(Register, Register);
+    void add(int64_t, Register);
     void sub(Register, Register);
     void sub(int64_t, Register);
+    void addDouble(FPRegister, FPRegister);
+    void subDouble(FPRegister, FPRegister);
+    void mulDouble(FPRegister, FPRegister);
+    void divDouble(FPRegister, FPRegister);
     void shiftl(uint8_t, Register);
     void bitAnd(int64_t, Register);
     void bitOr(int64_t, Register);
@@ -87,6 +100,9 @@ private:
     void jump(Label&);
     void jumpIfEqual(int32_t);
     void jumpIfEqual(Label&);
+    void jumpIfNotEqual(Label&);
+    // After compareDouble, taken if either operand is NaN
+    void jumpIfUnordered(Label&);
     void push(Register);
     void pop(Register);
     void ret();
@@ -102,9 +118,13 @@ private:
 #include "X64Primitives.h.inl"
 
 #define DECLARE_OP(Instruction) void emit##Instruction(const Instruction&);
-    FOR_EACH_INSTRUCTION(DECLARE_OP)
+    FOR_EACH_RUNTIME_INSTRUCTION(DECLARE_OP)
 #undef DECLARE_OP
 
+    template<typename Instruction, typename Functor>
+    void emitNumericOperator(const Instruction&, Function*, const Functor&);
+    void emitGetField(uint32_t fieldIndex, uint32_t cacheIndex);
+
     VM& m_vm;
     const BytecodeBlock& m_block;
     uint32_t m_bytecodeOffset;
@@ -41,6 +41,11 @@ enum JIT::Register : uint8_t {
 
 static constexpr JIT::Register tmpRegister = static_cast<JIT::Register>(r9);
 
+enum JIT::FPRegister : uint8_t {
+    fpRegT0 = 0, // xmm0
+    fpRegT1 = 1, // xmm1
+};
+
 namespace REX {
 static constexpr JIT::Register NoR = static_cast<JIT::Register>(0);
 static constexpr JIT::Register NoX = static_cast<JIT::Register>(0);
@@ -66,6 +71,7 @@ enum JIT::Opcode : uint8_t {
     OP_2BYTE_ESCAPE = 0x0F,
     OP_GROUP5_Ev = 0xFF,
     OP_CMP_EvGv = 0x39,
+    OP_ADD_EvGv = 0x01,
     OP_SUB_EvGv = 0x29,
     OP_JMP_rel32 = 0xE9,
     OP_LEA = 0x8D,
@@ -78,12 +84,26 @@ enum JIT::Opcode : uint8_t {
     OP_GROUP1_EvIz = 0x81,
 };
 
+static constexpr uint8_t PRE_SSE_66 = 0x66;
+static constexpr uint8_t PRE_SSE_F2 = 0xF2;
+
 static constexpr uint8_t OP2_JCC_rel32 = 0x80;
 static constexpr uint8_t OP2_SETCC = 0x90;
+static constexpr uint8_t OP2_UCOMISD_VsdWsd = 0x2E;
+static constexpr uint8_t OP2_ADDSD_VsdWsd = 0x58;
+static constexpr uint8_t OP2_MULSD_VsdWsd = 0x59;
+static constexpr uint8_t OP2_SUBSD_VsdWsd = 0x5C;
+static constexpr uint8_t OP2_DIVSD_VsdWsd = 0x5E;
+static constexpr uint8_t OP2_MOVQ_VqEq = 0x6E;
+static constexpr uint8_t OP2_MOVQ_EqVq = 0x7E;
 static constexpr uint8_t GROUP5_OP_CALLN = 0x2;
 static constexpr uint8_t GROUP2_OP_SHL = 0x4;
 static constexpr uint8_t GROUP1_OP_CMP = 0x7;
+static constexpr uint8_t ConditionAE = 0x3;
 static constexpr uint8_t ConditionE = 0x4;
+static constexpr uint8_t ConditionNE = 0x5;
+static constexpr uint8_t ConditionA = 0x7;
+static constexpr uint8_t ConditionP = 0xA;
 
 enum class JIT::ModRM : uint8_t {
     None,
@@ -116,6 +136,26 @@ void JIT::move(uint64_t immediate, Register dst)
     emitQuad(immediate);
 }
 
+void JIT::move(Register src, FPRegister dst)
+{
+    // movq %src, %dst
+    emitByte(PRE_SSE_66);
+    emitRex(dst, REX::NoX, src);
+    emitOpcode(OP_2BYTE_ESCAPE);
+    emitByte(OP2_MOVQ_VqEq);
+    emitModRm(ModRM::Register, dst, src);
+}
+
+void JIT::move(FPRegister src, Register dst)
+{
+    // movq %src, %dst
+    emitByte(PRE_SSE_66);
+    emitRex(src, REX::NoX, dst);
+    emitOpcode(OP_2BYTE_ESCAPE);
+    emitByte(OP2_MOVQ_EqVq);
+    emitModRm(ModRM::Register, src, dst);
+}
+
 void JIT::lea(Offset offset, Register dst)
 {
     move(OP_LEA, dst, offset);
@@ -150,6 +190,15 @@ void JIT::compare(Register lhs, Register rhs)
     emitModRm(ModRM::Register, rhs, lhs);
 }
 
+void JIT::compareDouble(FPRegister lhs, FPRegister rhs)
+{
+    // ucomisd %rhs, %lhs
+    emitByte(PRE_SSE_66);
+    emitOpcode(OP_2BYTE_ESCAPE);
+    emitByte(OP2_UCOMISD_VsdWsd);
+    emitModRm(ModRM::Register, lhs, static_cast<Register>(rhs));
+}
+
 void JIT::setEqual(Register dst)
 {
     emitRex(REX::NoR, REX::NoX, dst);
@@ -158,6 +207,40 @@ void JIT::setEqual(Register dst)
     emitModRm(ModRM::Register, /* ignored */ 0, dst);
 }
 
+void JIT::setNotEqual(Register dst)
+{
+    emitRex(REX::NoR, REX::NoX, dst);
+    emitCondition(OP2_SETCC, ConditionNE);
+    emitModRm(ModRM::Register, /* ignored */ 0, dst);
+}
+
+void JIT::setAbove(Register dst)
+{
+    emitRex(REX::NoR, REX::NoX, dst);
+    emitCondition(OP2_SETCC, ConditionA);
+    emitModRm(ModRM::Register, /* ignored */ 0, dst);
+}
+
+void JIT::setAboveOrEqual(Register dst)
+{
+    emitRex(REX::NoR, REX::NoX, dst);
+    emitCondition(OP2_SETCC, ConditionAE);
+    emitModRm(ModRM::Register, /* ignored */ 0, dst);
+}
+
+void JIT::add(int64_t immediate, Register reg)
+{
+    move(immediate, tmpRegister);
+    add(tmpRegister, reg);
+}
+
+void JIT::add(Register src, Register dst)
+{
+    emitRex(src, REX::NoX, dst);
+    emitOpcode(OP_ADD_EvGv);
+    emitModRm(ModRM::Register, src, dst);
+}
+
 void JIT::sub(int64_t immediate, Register reg)
 {
     move(immediate, tmpRegister);
@@ -171,6 +254,30 @@ void JIT::sub(Register lhs, Register rhs)
     emitModRm(ModRM::Register, lhs, rhs);
 }
 
+// addsd %src, %dst
+void JIT::addDouble(FPRegister src, FPRegister dst)
+{
+    emitScalarDouble(OP2_ADDSD_VsdWsd, src, dst);
+}
+
+// subsd %src, %dst
+void JIT::subDouble(FPRegister src, FPRegister dst)
+{
+    emitScalarDouble(OP2_SUBSD_VsdWsd, src, dst);
+}
+
+// mulsd %src, %dst
+void JIT::mulDouble(FPRegister src, FPRegister dst)
+{
+    emitScalarDouble(OP2_MULSD_VsdWsd, src, dst);
+}
+
+// divsd %src, %dst
+void JIT::divDouble(FPRegister src, FPRegister dst)
+{
+    emitScalarDouble(OP2_DIVSD_VsdWsd, src, dst);
+}
+
 void JIT::shiftl(uint8_t immediate, Register reg)
 {
     emitRex(GROUP2_OP_SHL, REX::NoX, reg);
@@ -222,6 +329,18 @@ void JIT::jumpIfEqual(Label& target)
     emitJumpTarget(target);
 }
 
+void JIT::jumpIfNotEqual(Label& target)
+{
+    emitCondition(OP2_JCC_rel32, ConditionNE);
+    emitJumpTarget(target);
+}
+
+void JIT::jumpIfUnordered(Label& target)
+{
+    emitCondition(OP2_JCC_rel32, ConditionP);
+    emitJumpTarget(target);
+}
+
 void JIT::push(Register reg)
 {
     emitOpcode(OP_PUSH_EAX, reg);
@@ -288,3 +407,19 @@ void JIT::emitOpcode(uint8_t opcode, uint8_t extra)
 {
     emitByte(opcode + (extra & 7));
 }
+
+// Two byte opcodes that take any of the 16 condition codes, e.g. jcc and setcc
+void JIT::emitCondition(uint8_t opcode, uint8_t condition)
+{
+    emitOpcode(OP_2BYTE_ESCAPE);
+    emitByte(opcode + (condition & 0xF));
+}
+
+// Only xmm0-7, which don't need a REX prefix
+void JIT::emitScalarDouble(uint8_t opcode, FPRegister src, FPRegister dst)
+{
+    emitByte(PRE_SSE_F2);
+    emitOpcode(OP_2BYTE_ESCAPE);
+    emitByte(opcode);
+    emitModRm(ModRM::Register, dst, static_cast<Register>(src));
+}
@@ -10,3 +10,5 @@ void emitModRm(ModRM, uint8_t, Register, Register);
 void emitSib(uint8_t, Register, Register);
 void emitOpcode(Opcode);
 void emitOpcode(uint8_t, uint8_t);
+void emitCondition(uint8_t opcode, uint8_t condition);
+void emitScalarDouble(uint8_t opcode, FPRegister, FPRegister);
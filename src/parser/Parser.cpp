@@ -615,8 +615,10 @@ std::unique_ptr<TypedIdentifier> Parser::parseTypedIdentifier(const Token& t)
     if (m_lexer.peek().type == Token::LESS_COLON) {
         CONSUME(Token::LESS_COLON);
         typedIdentifier->isSubtype = true;
-    } else
+    } else {
         CONSUME(Token::COLON);
+        typedIdentifier->isSubtype = false;
+    }
     typedIdentifier->type = parseInferredExpression(m_lexer.next());
     return typedIdentifier;
 }
@@ -1,4 +1,5 @@
 #include "Assert.h"
+#include "InstructionPairProfile.h"
 #include "Interpreter.h"
 #include "Lexer.h"
 #include "Parser.h"
@@ -7,12 +8,74 @@
 #include <iostream>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+
+static const char* optionValue(const char* argument, const char* option)
+{
+    size_t length = strlen(option);
+    if (strncmp(argument, option, length))
+        return nullptr;
+    return argument + length;
+}
+
+// Sizes are in bytes, with an optional K, M or G suffix
+static size_t parseSize(const char* argument, const char* value)
+{
+    char* end;
+    size_t size = strtoull(value, &end, 10);
+    ASSERT(end != value, "Invalid size: %s", argument);
+    switch (*end) {
+    case 'K':
+        size <<= 10;
+        ++end;
+        break;
+    case 'M':
+        size <<= 20;
+        ++end;
+        break;
+    case 'G':
+        size <<= 30;
+        ++end;
+        break;
+    }
+    ASSERT(!*end, "Invalid size: %s", argument);
+    return size;
+}
+
+static double parseFraction(const char* argument, const char* value)
+{
+    char* end;
+    double fraction = strtod(value, &end);
+    ASSERT(end != value && !*end, "Invalid fraction: %s", argument);
+    return fraction;
+}
 
 int main(int argc, const char** argv)
 {
-    ASSERT(argc == 2, "Expected target file as the only argument");
+    HeapOptions heapOptions;
+    const char* filename = nullptr;
+    // DUMP_BYTECODE is the older spelling of --dump-bytecode
+    bool dumpBytecode = getenv("DUMP_BYTECODE");
+    bool profileInstructionPairs = false;
+    for (int i = 1; i < argc; ++i) {
+        const char* argument = argv[i];
+        if (const char* value = optionValue(argument, "--min-heap-size="))
+            heapOptions.minHeapSize = parseSize(argument, value);
+        else if (const char* value = optionValue(argument, "--max-heap-size="))
+            heapOptions.maxHeapSize = parseSize(argument, value);
+        else if (const char* value = optionValue(argument, "--target-heap-utilization="))
+            heapOptions.targetUtilization = parseFraction(argument, value);
+        else if (!strcmp(argument, "--dump-bytecode"))
+            dumpBytecode = true;
+        else if (!strcmp(argument, "--profile-instruction-pairs"))
+            profileInstructionPairs = true;
+        else {
+            ASSERT(!filename, "Expected a single target file");
+            filename = argument;
+        }
+    }
+    ASSERT(filename, "Usage: reach [--min-heap-size=<size>] [--max-heap-size=<size>] [--target-heap-utilization=<fraction>] [--dump-bytecode] [--profile-instruction-pairs] <file>");
 
-    const char* filename = argv[1];
     FILE* file = fopen(filename, "r");
     ASSERT(file, "Cannot open target file: %s", filename);
 
@@ -33,7 +96,11 @@ int main(int argc, const char** argv)
         return EXIT_FAILURE;
     }
 
-    VM vm;
+    VM vm(heapOptions);
+    vm.dumpBytecode = dumpBytecode;
+    InstructionPairProfile instructionPairProfile;
+    if (profileInstructionPairs)
+        vm.instructionPairProfile = &instructionPairProfile;
     BytecodeGenerator generator(vm);
     program->typecheck(generator);
     auto bytecode = program->generate(generator);
@@ -41,6 +108,8 @@ int main(int argc, const char** argv)
     Value type = Interpreter::check(vm, *bytecode, vm.globalEnvironment);
     Value result = Interpreter::run(vm, *bytecode, vm.globalEnvironment);
     std::cout << "End: " << result << " : " << type << std::endl;
+    if (profileInstructionPairs)
+        instructionPairProfile.dump(std::cerr);
 
     return EXIT_SUCCESS;
 }
@@ -1,87 +1,272 @@
 #include "Allocator.h"
 
 #include "Assert.h"
+#include "Cell.h"
+#include "VM.h"
 #include <stdlib.h>
-
-std::unordered_map<size_t, Allocator*> Allocator::s_allocators;
+#include <string.h>
 
 Allocator::Allocator(VM* vm, size_t cellSize)
-    : m_cellSize(cellSize)
+    : m_vm(vm)
+    , m_cellSize(cellSize)
+    , m_cellsPerBlock((s_blockSize - sizeof(Header)) / cellSize)
+    , m_bitmapWords((m_cellsPerBlock + s_bitsPerWord - 1) / s_bitsPerWord)
+    , m_lastWordMask(m_cellsPerBlock % s_bitsPerWord ? (1ull << (m_cellsPerBlock % s_bitsPerWord)) - 1 : ~0ull)
 {
-    int result = posix_memalign(reinterpret_cast<void**>(&m_header), s_blockSize, s_blockSize);
-    ASSERT(!result, "Failed to create allocation block");
-    *m_header = Header { vm };
-    m_start = reinterpret_cast<uint8_t*>(m_header + 1);
-    m_current = m_start;
-    m_end = reinterpret_cast<uint8_t*>(m_header) + s_blockSize;
+    ASSERT(cellSize < s_blockSize - sizeof(Header), "Allocation is too big: %lu", cellSize);
+    ASSERT(cellSize >= s_minCellSize, "Allocation is too small: %lu", cellSize);
+    addBlock();
 }
 
 Allocator::~Allocator()
 {
-    ::free(m_start);
+    for (Header* block : m_blocks) {
+        for (size_t word = 0; word < m_bitmapWords; ++word) {
+            for (uint64_t bits = block->live[word] | block->dead[word]; bits; bits &= bits - 1)
+                cellAt(block, word * s_bitsPerWord + __builtin_ctzll(bits))->~Cell();
+        }
+        ::free(block);
+    }
+}
+
+bool Allocator::isCellAddress(const Cell* cell)
+{
+    Header* block = blockFor(cell);
+    const uint8_t* address = reinterpret_cast<const uint8_t*>(cell);
+    const uint8_t* start = reinterpret_cast<uint8_t*>(block + 1);
+    if (address < start)
+        return false;
+    size_t offset = address - start;
+    return !(offset % block->cellSize) && offset + block->cellSize <= s_blockSize - sizeof(Header);
+}
+
+bool Allocator::isFree(const Cell* cell)
+{
+    Header* block = blockFor(cell);
+    size_t index = cellIndex(block, cell);
+    return !(block->live[index / s_bitsPerWord] & (1ull << (index % s_bitsPerWord)));
+}
+
+bool Allocator::isMarked(const Cell* cell)
+{
+    Header* block = blockFor(cell);
+    size_t index = cellIndex(block, cell);
+    return block->marks[index / s_bitsPerWord] & (1ull << (index % s_bitsPerWord));
+}
+
+bool Allocator::testAndSetMarked(const Cell* cell)
+{
+    Header* block = blockFor(cell);
+    size_t index = cellIndex(block, cell);
+    uint64_t bit = 1ull << (index % s_bitsPerWord);
+    return __atomic_fetch_or(&block->marks[index / s_bitsPerWord], bit, __ATOMIC_RELAXED) & bit;
+}
+
+bool Allocator::testAndSetTraced(const Cell* cell)
+{
+    Header* block = blockFor(cell);
+    size_t index = cellIndex(block, cell);
+    uint64_t bit = 1ull << (index % s_bitsPerWord);
+    return __atomic_fetch_or(&block->traced[index / s_bitsPerWord], bit, __ATOMIC_RELAXED) & bit;
 }
 
-Allocator& Allocator::forSize(VM* vm, size_t size)
+bool Allocator::testAndSetRemembered(const Cell* cell)
 {
-    ASSERT(size < s_blockSize, "Allocation is too big: %lu", size);
-    auto it = s_allocators.find(size);
-    if (it != s_allocators.end())
-        return *it->second;
-    Allocator* allocator = new Allocator(vm, size);
-    s_allocators[size] = allocator;
-    return *allocator;
+    Header* block = blockFor(cell);
+    size_t index = cellIndex(block, cell);
+    uint64_t& word = block->remembered[index / s_bitsPerWord];
+    uint64_t bit = 1ull << (index % s_bitsPerWord);
+    bool wasRemembered = word & bit;
+    word |= bit;
+    return wasRemembered;
 }
 
-void Allocator::each(const std::function<IterationResult(Allocator&)>& functor)
+void Allocator::clearRemembered(const Cell* cell)
 {
-    for (auto& pair : s_allocators) {
-        if (functor(*pair.second) == IterationResult::Stop)
-            break;
+    Header* block = blockFor(cell);
+    size_t index = cellIndex(block, cell);
+    block->remembered[index / s_bitsPerWord] &= ~(1ull << (index % s_bitsPerWord));
+}
+
+Cell* Allocator::cell()
+{
+    if (!m_freeBits && !loadFreeBits())
+        return nullptr;
+
+    unsigned bit = __builtin_ctzll(m_freeBits);
+    m_freeBits &= m_freeBits - 1;
+    --m_freeCellCount;
+
+    Header* block = m_blocks[m_freeBlock];
+    size_t word = m_freeWord - 1;
+    block->live[word] |= 1ull << bit;
+    if (m_allocatesBlack) {
+        // The marking threads might be updating the same words
+        __atomic_fetch_or(&block->marks[word], 1ull << bit, __ATOMIC_RELAXED);
+        __atomic_fetch_or(&block->traced[word], 1ull << bit, __ATOMIC_RELAXED);
     }
+    return cellAt(block, word * s_bitsPerWord + bit);
 }
 
-void Allocator::each(const std::function<void(Cell*)>& functor)
+void Allocator::prepareForMarking(CollectionScope scope)
 {
-    for (uint8_t* cell = m_start; cell != m_current; cell += m_cellSize) {
-        if (*cell == s_freeMarker)
+    std::vector<Header*> blocks;
+    std::vector<Header*> emptyBlocks;
+    for (size_t i = 0; i < m_blocks.size(); ++i) {
+        Header* block = m_blocks[i];
+        bool isSwept = i < m_sweptBlocks;
+        if (isEmpty(block, isSwept)) {
+            if (!isSwept)
+                sweepBlock(block);
+            emptyBlocks.emplace_back(block);
             continue;
-        functor(reinterpret_cast<Cell*>(cell));
+        }
+
+        blocks.emplace_back(block);
+        if (!isSwept) {
+            // Sweeping is left for when we allocate into this block, but its live
+            // bitmap has to be accurate before we can start marking again.
+            for (size_t word = 0; word < m_bitmapWords; ++word) {
+                uint64_t live = block->live[word];
+                uint64_t marks = block->marks[word] & live;
+                block->dead[word] |= live & ~marks;
+                block->live[word] = marks;
+                block->marks[word] = marks;
+            }
+        }
+
+        if (scope == CollectionScope::Full) {
+            memset(block->marks, 0, sizeof(block->marks));
+            memset(block->remembered, 0, sizeof(block->remembered));
+        }
+        memset(block->traced, 0, sizeof(block->traced));
+    }
+
+    // Keep one block around so that we don't have to immediately allocate it again
+    if (blocks.empty() && !emptyBlocks.empty()) {
+        blocks.emplace_back(emptyBlocks.back());
+        emptyBlocks.pop_back();
     }
+
+    for (Header* block : emptyBlocks) {
+        m_vm->heap.unregisterBlock(block);
+        ::free(block);
+    }
+    m_blocks.swap(blocks);
+    m_sweptBlocks = m_blocks.size();
+
+    // With concurrent marking we keep allocating until the collection finishes,
+    // so the cursor has to skip the dead cells that are yet to be destroyed.
+    m_freeCellCount = 0;
+    for (Header* block : m_blocks) {
+        size_t usedCells = 0;
+        for (size_t word = 0; word < m_bitmapWords; ++word)
+            usedCells += __builtin_popcountll(block->live[word] | block->dead[word]);
+        m_freeCellCount += m_cellsPerBlock - usedCells;
+    }
+    m_freeBlock = 0;
+    m_freeWord = 0;
+    m_freeBits = 0;
 }
 
-Cell* Allocator::cell()
+void Allocator::startSweeping()
 {
-    if (!m_freeList.empty()) {
-        Cell* cell = m_freeList.front();
-        m_freeList.pop();
-        return cell;
+    m_freeCellCount = 0;
+    for (Header* block : m_blocks) {
+        size_t liveCells = 0;
+        for (size_t word = 0; word < m_bitmapWords; ++word)
+            liveCells += __builtin_popcountll(block->marks[word]);
+        m_freeCellCount += m_cellsPerBlock - liveCells;
     }
 
-    if (m_current + m_cellSize <= m_end) {
-        Cell* result = reinterpret_cast<Cell*>(m_current);
-        m_current += m_cellSize;
-        return result;
-    }
+    m_sweptBlocks = 0;
+    m_freeBlock = 0;
+    m_freeWord = 0;
+    m_freeBits = 0;
+}
 
-    return nullptr;
+void Allocator::addBlock()
+{
+    Header* block;
+    int result = posix_memalign(reinterpret_cast<void**>(&block), s_blockSize, s_blockSize);
+    ASSERT(!result, "Failed to create allocation block");
+    block->vm = m_vm;
+    block->cellSize = m_cellSize;
+    memset(block->marks, 0, sizeof(block->marks));
+    memset(block->live, 0, sizeof(block->live));
+    memset(block->dead, 0, sizeof(block->dead));
+    memset(block->remembered, 0, sizeof(block->remembered));
+    memset(block->traced, 0, sizeof(block->traced));
+    m_blocks.emplace_back(block);
+    m_vm->heap.registerBlock(block);
+    m_freeCellCount += m_cellsPerBlock;
 }
 
-void Allocator::free(Cell* cell)
+auto Allocator::blockFor(const Cell* cell) -> Header*
 {
-    uint8_t* address = reinterpret_cast<uint8_t*>(cell);
-    ASSERT(address >= m_start && address < m_current, "Cell does not belong to this allocator");
-    // TODO: Debug only
-    memset(address, 0, m_cellSize);
-    *address = s_freeMarker;
-    m_freeList.push(cell);
+    return reinterpret_cast<Header*>(reinterpret_cast<uintptr_t>(cell) & ~s_blockMask);
 }
 
-bool Allocator::contains(const Cell* cell)
+size_t Allocator::cellIndex(Header* block, const Cell* cell)
 {
-    if ((reinterpret_cast<uintptr_t>(cell) & ~s_blockMask) != reinterpret_cast<uintptr_t>(m_header))
-        return false;
-    const uint8_t* address = reinterpret_cast<const uint8_t*>(cell);
-    if ((address - m_start) % m_cellSize)
-        return false;
+    return (reinterpret_cast<const uint8_t*>(cell) - reinterpret_cast<uint8_t*>(block + 1)) / block->cellSize;
+}
+
+uint8_t* Allocator::blockStart(Header* block) const
+{
+    return reinterpret_cast<uint8_t*>(block + 1);
+}
+
+Cell* Allocator::cellAt(Header* block, size_t index) const
+{
+    return reinterpret_cast<Cell*>(blockStart(block) + index * m_cellSize);
+}
+
+void Allocator::sweepBlock(Header* block)
+{
+    for (size_t word = 0; word < m_bitmapWords; ++word) {
+        uint64_t live = block->live[word];
+        uint64_t marks = block->marks[word] & live;
+        for (uint64_t dead = (live & ~marks) | block->dead[word]; dead; dead &= dead - 1)
+            cellAt(block, word * s_bitsPerWord + __builtin_ctzll(dead))->~Cell();
+        block->live[word] = marks;
+        block->marks[word] = marks;
+        block->dead[word] = 0;
+    }
+}
+
+bool Allocator::isEmpty(Header* block, bool isSwept) const
+{
+    for (size_t word = 0; word < m_bitmapWords; ++word) {
+        uint64_t live = block->live[word];
+        if (!isSwept)
+            live &= block->marks[word];
+        if (live)
+            return false;
+    }
     return true;
 }
+
+// Move the allocation cursor to the next bitmap word with free cells, sweeping
+// blocks as we reach them
+bool Allocator::loadFreeBits()
+{
+    for (; m_freeBlock < m_blocks.size(); ++m_freeBlock, m_freeWord = 0) {
+        Header* block = m_blocks[m_freeBlock];
+        if (m_freeBlock == m_sweptBlocks) {
+            sweepBlock(block);
+            ++m_sweptBlocks;
+        }
+        while (m_freeWord < m_bitmapWords) {
+            size_t word = m_freeWord++;
+            uint64_t freeBits = ~(block->live[word] | block->dead[word]);
+            if (word == m_bitmapWords - 1)
+                freeBits &= m_lastWordMask;
+            if (freeBits) {
+                m_freeBits = freeBits;
+                return true;
+            }
+        }
+    }
+    return false;
+}
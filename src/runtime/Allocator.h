@@ -1,8 +1,7 @@
 #pragma once
 
 #include <limits>
-#include <queue>
-#include <unordered_map>
+#include <vector>
 
 class Cell;
 class VM;
@@ -12,37 +11,100 @@ enum class IterationResult {
     Continue,
 };
 
+enum class CollectionScope {
+    // Only collect cells allocated since the previous collection
+    Eden,
+    Full,
+};
+
 class Allocator {
     friend class Cell;
+    friend class Heap;
 
 public:
-    static Allocator& forSize(VM*, size_t);
-    static void each(const std::function<IterationResult(Allocator&)>&);
+    // Whether `cell` is the address of a cell slot, given that it points into one of our blocks
+    static bool isCellAddress(const Cell*);
+    static bool isFree(const Cell*);
+    static bool isMarked(const Cell*);
+    // Atomically sets the mark bit, returning whether it was already set
+    static bool testAndSetMarked(const Cell*);
+    // Atomically sets the traced bit, returning whether it was already set
+    static bool testAndSetTraced(const Cell*);
+    // Returns whether the cell was already in the remembered set
+    static bool testAndSetRemembered(const Cell*);
+    static void clearRemembered(const Cell*);
 
     ~Allocator();
 
     Cell* cell();
-    void free(Cell*);
-    bool contains(const Cell*);
-    void each(const std::function<void(Cell*)>&);
 
-private:
-    struct Header {
-        VM* vm;
-    };
+    // Called before marking: return blocks without live cells to the OS and
+    // fold the dead cells of blocks that were never swept into their `dead` bitmap.
+    // Mark bits are sticky: they are only cleared for full collections, so an
+    // eden collection sees every cell that survived a previous one as marked.
+    void prepareForMarking(CollectionScope);
+    // Called after marking: blocks are swept lazily, one at a time, as cell() reaches them.
+    void startSweeping();
+    // Grow the size class by one block.
+    void addBlock();
+    // While marking concurrently, new cells are allocated marked and traced so
+    // that the collector neither frees nor visits them.
+    void setAllocatesBlack(bool allocatesBlack) { m_allocatesBlack = allocatesBlack; }
+
+    size_t cellSize() const { return m_cellSize; }
+    size_t freeCellCount() const { return m_freeCellCount; }
+    size_t liveCellCount() const { return m_blocks.size() * m_cellsPerBlock - m_freeCellCount; }
+    size_t cellsPerBlock() const { return m_cellsPerBlock; }
+    size_t blockCount() const { return m_blocks.size(); }
 
-    constexpr static uint8_t s_freeMarker = std::numeric_limits<uint8_t>::max();
+private:
     static constexpr size_t s_blockSize = 0x10000;
     static constexpr uintptr_t s_blockMask = s_blockSize - 1;
+    // sizeof(Cell): a vtable pointer and the cell kind
+    static constexpr size_t s_minCellSize = 16;
+    static constexpr size_t s_bitsPerWord = 64;
+    static constexpr size_t s_bitmapWords = s_blockSize / s_minCellSize / s_bitsPerWord;
 
-    static std::unordered_map<size_t, Allocator*> s_allocators;
+    struct Header {
+        VM* vm;
+        size_t cellSize;
+        // One bit per cell: set in `marks` once the collector reaches the cell,
+        // in `live` while the cell is allocated, in `dead` for cells that were
+        // found unreachable but haven't been destroyed yet, in `remembered`
+        // while the cell is in the heap's remembered set, and in `traced` once
+        // the references it holds have been visited by the current collection.
+        uint64_t marks[s_bitmapWords];
+        uint64_t live[s_bitmapWords];
+        uint64_t dead[s_bitmapWords];
+        uint64_t remembered[s_bitmapWords];
+        uint64_t traced[s_bitmapWords];
+    };
 
     Allocator(VM*, size_t);
 
+    static Header* blockFor(const Cell*);
+    static size_t cellIndex(Header*, const Cell*);
+    uint8_t* blockStart(Header*) const;
+    Cell* cellAt(Header*, size_t) const;
+    void sweepBlock(Header*);
+    bool isEmpty(Header*, bool isSwept) const;
+    bool loadFreeBits();
+
+    VM* m_vm;
     size_t m_cellSize;
-    Header* m_header;
-    uint8_t* m_start;
-    uint8_t* m_end;
-    uint8_t* m_current;
-    std::queue<Cell*> m_freeList;
+    size_t m_cellsPerBlock;
+    size_t m_bitmapWords;
+    uint64_t m_lastWordMask;
+    size_t m_freeCellCount { 0 };
+    bool m_allocatesBlack { false };
+    std::vector<Header*> m_blocks;
+
+    // Blocks before this index have been swept since the last collection
+    size_t m_sweptBlocks { 0 };
+
+    // Allocation cursor: the bits left in m_freeBits are the free cells of word
+    // m_freeWord - 1 of m_blocks[m_freeBlock] that haven't been handed out yet.
+    size_t m_freeBlock { 0 };
+    size_t m_freeWord { 0 };
+    uint64_t m_freeBits { 0 };
 };
@@ -3,6 +3,7 @@
 void Array::visit(const Visitor& visitor) const
 {
     Typed::visit(visitor);
+    visitor.reportStorage(m_items.capacity() * sizeof(Value));
     for (auto item : m_items)
         visitor.visit(item);
 }
@@ -10,6 +10,7 @@ public:
     void setIndex(uint32_t index, Value item)
     {
         ASSERT(index < m_items.size(), "Array index out of bounds: %u", index);
+        Heap::WriteBarrier barrier(this);
         m_items[index] = item;
     }
 
@@ -25,11 +26,13 @@ public:
         return m_items[index];
     }
 
+    using Items = std::vector<Value, StorageAllocator<Value>>;
+
     size_t size() const { return m_items.size(); }
-    std::vector<Value>::iterator begin() { return m_items.begin(); }
-    std::vector<Value>::iterator end() { return m_items.end(); }
-    std::vector<Value>::const_iterator begin() const { return m_items.begin(); }
-    std::vector<Value>::const_iterator end() const { return m_items.end(); }
+    Items::iterator begin() { return m_items.begin(); }
+    Items::iterator end() { return m_items.end(); }
+    Items::const_iterator begin() const { return m_items.begin(); }
+    Items::const_iterator end() const { return m_items.end(); }
 
     bool operator==(const Array&) const;
     Array* substitute(VM&, const Substitutions&) const;
@@ -41,25 +44,25 @@ protected:
 
     Array(Type* type, uint32_t initialSize)
         : Typed(type)
-        , m_items(initialSize)
+        , m_items(initialSize, vm().heap)
     {
     }
 
     template<typename T>
     Array(Type* type, const std::vector<T>& vector)
         : Typed(type)
-        , m_items(vector.begin(), vector.end())
+        , m_items(vector.begin(), vector.end(), vm().heap)
     {
     }
 
 private:
     Array(Type* type, uint32_t itemCount, const Value* items)
         : Typed(type)
-        , m_items(items, items + itemCount)
+        , m_items(items, items + itemCount, vm().heap)
     {
     }
 
-    std::vector<Value> m_items;
+    Items m_items;
 };
 
 extern Array* createArray(VM&, Type*, uint32_t);
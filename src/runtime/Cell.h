@@ -111,7 +111,6 @@ public:
 protected:
     virtual void visit(const Visitor&) const = 0;
 
-    bool m_isMarked;
     Kind m_kind { 0 };
 };
 
@@ -34,12 +34,12 @@ public:
         T* operator->() { return m_iterator->asCell<T>(); }
 
     private:
-        explicit iterator(std::vector<Value>::iterator iterator)
+        explicit iterator(Array::Items::iterator iterator)
             : m_iterator(iterator)
         {
         }
 
-        std::vector<Value>::iterator m_iterator;
+        Array::Items::iterator m_iterator;
     };
 
     iterator begin() { return iterator { Array::begin() }; }
@@ -2,11 +2,23 @@
 
 #include "expressions.h"
 #include "Value.h"
+#include <algorithm>
 #include <sstream>
 
-Environment::Environment(Environment* parent)
+Environment::Environment(Environment* parent, uint32_t size)
     : m_parent(parent)
+    , m_size(size)
 {
+    if (!size)
+        return;
+    m_slots = static_cast<Value*>(vm().heap.allocateStorage(size * sizeof(Value)));
+    std::fill(m_slots, m_slots + size, Value::crash());
+}
+
+Environment::~Environment()
+{
+    if (m_slots)
+        vm().heap.freeStorage(m_slots, m_size * sizeof(Value));
 }
 
 void Environment::set(const Identifier& key, Value value)
@@ -16,7 +28,9 @@ void Environment::set(const Identifier& key, Value value)
 
 void Environment::set(const std::string& key, Value value)
 {
+    Heap::WriteBarrier barrier(this);
     m_map[key] = value;
+    vm().didBind(this, key, value);
 }
 
 Value Environment::get(const std::string& key, bool& success) const
@@ -33,6 +47,28 @@ Value Environment::get(const std::string& key, bool& success) const
     return m_parent->get(key, success);
 }
 
+void Environment::setCaptured(uint32_t slot, Value value)
+{
+    ASSERT(slot < m_size, "Captured variable out of bounds: %u", slot);
+    Heap::WriteBarrier barrier(this);
+    m_slots[slot] = value;
+}
+
+Value Environment::getCaptured(uint32_t depth, uint32_t slot, const std::string& name, bool& success) const
+{
+    const Environment* environment = this;
+    while (depth--)
+        environment = environment->m_parent;
+    if (slot < environment->m_size) {
+        success = true;
+        return environment->m_slots[slot];
+    }
+
+    // Only type checking code binds names, so this finds the nearest binding
+    // of the environment we reached
+    return get(name, success);
+}
+
 Environment* Environment::parent() const
 {
     return m_parent;
@@ -41,6 +77,8 @@ Environment* Environment::parent() const
 void Environment::visit(const Visitor& visitor) const
 {
     visitor.visit(m_parent);
+    for (uint32_t i = 0; i < m_size; i++)
+        visitor.visit(m_slots[i]);
     for (const auto& pair : m_map)
         visitor.visit(pair.second);
     for (const auto& pair : m_typeMap)
@@ -73,9 +111,18 @@ int64_t jitEnvironmentGet(Environment* env, const std::string& variable)
     return value.bits();
 }
 
-void jitUnknownVariable(VM& vm, uint32_t bytecodeOffset, const std::string& variable)
+int64_t jitGetCapturedVariable(Environment* env, uint32_t depth, uint32_t slot, const std::string& variable)
+{
+    bool success;
+    Value value = env->getCaptured(depth, slot, variable, success);
+    if (!success)
+        value = Value::crash();
+    return value.bits();
+}
+
+void jitUnknownVariable(VM& vm, const BytecodeBlock& block, uint32_t bytecodeOffset, const std::string& variable)
 {
         std::stringstream message;
         message << "Unknown variable: `" << variable << "`";
-        vm.typeError(bytecodeOffset, message.str());
+        vm.typeError(block, bytecodeOffset, message.str());
 }
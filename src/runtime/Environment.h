@@ -8,15 +8,28 @@ class Identifier;
 class Value;
 
 class Environment  : public Cell {
+    friend class JIT;
+
     using Map = std::map<std::string, Value>;
 
 public:
     CELL(Environment);
 
+    ~Environment();
+
     void set(const Identifier& key, Value value);
     void set(const std::string& key, Value value);
     Value get(const std::string& key, bool& success) const;
 
+    // The environment of a closure holds the variables it captured, at the
+    // slots BytecodeGenerator assigned them. The environments of type checking
+    // code have none and only bind names, so a function created in one, i.e.
+    // one called while checking the block that declares it, finds its captured
+    // variables by `name` instead.
+    void setCaptured(uint32_t slot, Value);
+    Value getCaptured(uint32_t depth, uint32_t slot, const std::string& name, bool& success) const;
+    bool hasCapturedVariables() const { return m_slots; }
+
     Environment* parent() const;
     void dump(std::ostream&) const override;
 
@@ -24,9 +37,11 @@ protected:
     void visit(const Visitor&) const override;
 
 private:
-    Environment(Environment*);
+    Environment(Environment*, uint32_t size = 0);
 
     Environment* m_parent;
+    Value* m_slots { nullptr };
+    uint32_t m_size;
     Map m_map;
     Map m_typeMap;
 };
@@ -36,6 +51,7 @@ extern "C" {
 
 Environment* createEnvironment(VM&, Environment*);
 int64_t jitEnvironmentGet(Environment*, const std::string&);
-void jitUnknownVariable(VM&, uint32_t, const std::string&);
+int64_t jitGetCapturedVariable(Environment*, uint32_t, uint32_t, const std::string&);
+void jitUnknownVariable(VM&, const BytecodeBlock&, uint32_t, const std::string&);
 
 }
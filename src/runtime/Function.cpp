@@ -8,18 +8,53 @@ void Function::visit(const Visitor& visitor) const
     visitor.visit(m_parentEnvironment);
 }
 
-Value Function::call(VM& vm, std::vector<Value> args)
+BytecodeBlock* Function::interpretedBlock(VM& vm)
 {
-    if (m_nativeFunction) {
-        if (m_block)
-            return reinterpret_cast<Value(*)(uint32_t, Value*, Environment*)>(m_block->jitCode())(args.size(), &args[0], m_parentEnvironment);
-        return m_nativeFunction(vm, args);
-    }
+    if (m_nativeFunction)
+        return nullptr;
 
     if (m_block->optimize(vm)) {
-        m_nativeFunction = reinterpret_cast<Value(*)(VM&, std::vector<Value>)>(m_block->jitCode());
-        return call(vm, args);
+        m_nativeFunction = reinterpret_cast<NativeFunction>(m_block->jitCode());
+        return nullptr;
     }
 
-    return Interpreter::run(vm, *m_block, m_parentEnvironment, args);
+    return m_block;
+}
+
+Value Function::call(VM& vm, const Value* args, uint32_t argc)
+{
+    if (BytecodeBlock* block = interpretedBlock(vm))
+        return Interpreter::run(vm, *block, m_parentEnvironment, args, argc);
+
+    if (m_block)
+        return reinterpret_cast<Value(*)(uint32_t, const Value*, Environment*)>(m_block->jitCode())(argc, args, m_parentEnvironment);
+    return m_nativeFunction(vm, args, argc);
+}
+
+Function* Function::createClosure(VM& vm, Environment* environment) const
+{
+    // Skip the environment of the closure that creates this one, if that's
+    // where it runs, since it only holds the variables it captured
+    Environment* parentEnvironment = environment;
+    if (parentEnvironment->hasCapturedVariables())
+        parentEnvironment = parentEnvironment->parent();
+    if (uint32_t size = m_block->numCapturedVariables())
+        parentEnvironment = Environment::create(vm, parentEnvironment, size);
+    return Function::create(vm, *m_block, parentEnvironment, type());
+}
+
+Value callOperator(VM& vm, Value callee, Value lhs, Value rhs)
+{
+    Value args[] = { lhs, rhs };
+    return callee.asCell<Function>()->call(vm, args, 2);
+}
+
+// JIT helpers
+Environment* jitSelfTailCallEnvironment(VM& vm, Function* function, const BytecodeBlock* block)
+{
+    if (function->block() != block)
+        return nullptr;
+    if (!block->needsEnvironment())
+        return function->parentEnvironment();
+    return Environment::create(vm, function->parentEnvironment());
 }
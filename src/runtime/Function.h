@@ -6,17 +6,12 @@
 #include "VM.h"
 #include <vector>
 
-using NativeFunction = std::function<Value(VM&, std::vector<Value>)>;
+using NativeFunction = Value(*)(VM&, const Value* args, uint32_t argc);
 
 class Function : public Typed {
 public:
     CELL(Function)
 
-    void setParentEnvironment(Environment* parentEnvironment)
-    {
-        m_parentEnvironment = parentEnvironment;
-    }
-
     std::string name() const
     {
         if (m_block)
@@ -33,7 +28,23 @@ public:
             out << "<native function>";
     }
 
-    Value call(VM&, std::vector<Value>);
+    BytecodeBlock* block() const { return m_block; }
+    Environment* parentEnvironment() const { return m_parentEnvironment; }
+
+    // Each time the code that runs a block creates one of its functions, it
+    // gets a closure of its own, with the function created while type checking
+    // as a template. The environment of the closure only holds the variables it
+    // captures, which are then copied in with setCaptured, and leads straight
+    // to the environments that bind names, rather than to the one of the code
+    // that created it.
+    Function* createClosure(VM&, Environment*) const;
+    void setCaptured(uint32_t slot, Value value) { m_parentEnvironment->setCaptured(slot, value); }
+
+    // The block the interpreter should run for calls to this function, or
+    // nullptr if it's native or has been compiled
+    BytecodeBlock* interpretedBlock(VM&);
+
+    Value call(VM&, const Value* args, uint32_t argc);
 
 protected:
     void visit(const Visitor&) const override;
@@ -56,3 +67,15 @@ private:
     BytecodeBlock* m_block { nullptr };
     NativeFunction m_nativeFunction { nullptr };
 };
+
+// Calls whatever an operator's name refers to, when it isn't the VM's own
+// operator on numbers
+Value callOperator(VM&, Value callee, Value lhs, Value rhs);
+
+// JIT helpers
+extern "C" {
+
+// The environment for a tail call into `block`, or nullptr if `function` runs a different block
+Environment* jitSelfTailCallEnvironment(VM&, Function*, const BytecodeBlock*);
+
+}
@@ -2,7 +2,36 @@
 
 #include "BytecodeBlock.h"
 #include "Cell.h"
+#include "Log.h"
 #include "VM.h"
+#include <chrono>
+#include <sstream>
+
+static bool usesConcurrentMarking()
+{
+    static bool usesConcurrentMarking = std::getenv("GC_CONCURRENT_MARKING") && !std::getenv("NO_GC");
+    return usesConcurrentMarking;
+}
+
+static unsigned markingThreadCount()
+{
+    static unsigned count = std::getenv("GC_MARKING_THREADS")
+        ? std::max(atoi(std::getenv("GC_MARKING_THREADS")), 1)
+        : std::max(std::min(std::thread::hardware_concurrency(), 4u), 1u);
+    // Concurrent marking needs at least one thread besides the mutator
+    return usesConcurrentMarking() ? std::max(count, 2u) : count;
+}
+
+// Concurrent marking starts once three quarters of the budget are allocated
+static size_t collectionTrigger(size_t allocationBudget)
+{
+    return usesConcurrentMarking() ? allocationBudget / 4 * 3 : allocationBudget;
+}
+
+static long microsecondsSince(std::chrono::steady_clock::time_point start)
+{
+    return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+}
 
 void Visitor::visit(Value value) const
 {
@@ -13,20 +42,18 @@ void Visitor::visit(Value value) const
 void Visitor::visitConservatively(Value value) const
 {
     if (Cell* cell = getCell(value)) {
-        bool isValid = false;
-        Allocator::each([&](Allocator& allocator) {
-            if (allocator.contains(cell)) {
-                isValid = true;
-                return IterationResult::Stop;
-            }
-            return IterationResult::Continue;
-        });
-
-        if (!isValid)
+        if (!m_heap.contains(cell))
             return;
+        // CELL_CREATE only sets the kind once the constructor returns, so a cell
+        // without a kind is still being constructed and must be kept alive.
         uint32_t kind = static_cast<uint32_t>(cell->m_kind);
-        if (kind && (kind & Cell::KindMask) == kind)
-            visitCell(cell);
+        if ((kind & Cell::KindMask) != kind)
+            return;
+        // The marking threads can't visit it while the constructor runs, but
+        // anything it references is still held by the constructor's frame.
+        if (!kind && m_heap.m_isMarkingConcurrently)
+            Allocator::testAndSetTraced(cell);
+        visitCell(cell);
     }
 }
 
@@ -40,17 +67,83 @@ Cell* Visitor::getCell(Value value) const
 
 void Visitor::visitCell(Cell* cell) const
 {
-    if (m_heap.isMarked(cell))
+    if (Allocator::testAndSetMarked(cell))
         return;
 
-    m_heap.setMarked(cell);
-    m_heap.m_worklist.push(cell);
+    m_markStack.push(cell);
+    ++m_markedCells;
 }
 
-Heap::Heap(VM* vm)
+Heap::Heap(VM* vm, const HeapOptions& options)
     : m_vm(vm)
-    , m_visitor(*this)
+    , m_options(options)
+    , m_markStacks(markingThreadCount())
+    , m_visitor(*this, m_markStacks.front())
+    , m_allocationBudget(options.minHeapSize)
+    , m_collectionTrigger(std::getenv("NO_GC") ? std::numeric_limits<size_t>::max() : collectionTrigger(options.minHeapSize))
+    , m_markedCellsPerThread(markingThreadCount())
+    , m_usesConcurrentMarking(usesConcurrentMarking())
+{
+    ASSERT(options.targetUtilization > 0 && options.targetUtilization <= 1, "Target heap utilization must be in (0, 1]");
+    ASSERT(options.minHeapSize <= options.maxHeapSize, "Minimum heap size is bigger than the maximum heap size");
+}
+
+Heap::~Heap()
+{
+    if (m_isMarkingConcurrently)
+        waitForMarkingThreads();
+    {
+        std::lock_guard<std::mutex> lock(m_markingLock);
+        m_isShuttingDown = true;
+    }
+    m_markingCondition.notify_all();
+    for (auto& thread : m_markingThreads)
+        thread.join();
+    LOG(GC, "Allocated " << m_allocatedCells << " cells in total");
+}
+
+Allocator& Heap::allocatorForSize(size_t size)
+{
+    auto it = m_allocators.find(size);
+    if (it != m_allocators.end())
+        return *it->second;
+    Allocator* allocator = new Allocator(m_vm, size);
+    allocator->setAllocatesBlack(m_isMarkingConcurrently);
+    m_allocators.emplace(size, std::unique_ptr<Allocator>(allocator));
+    return *allocator;
+}
+
+void Heap::eachAllocator(const std::function<IterationResult(Allocator&)>& functor)
+{
+    for (auto& pair : m_allocators) {
+        if (functor(*pair.second) == IterationResult::Stop)
+            break;
+    }
+}
+
+size_t Heap::size() const
+{
+    size_t size = m_storage.size();
+    for (const auto& pair : m_allocators)
+        size += pair.second->blockCount() * Allocator::s_blockSize;
+    return size;
+}
+
+bool Heap::contains(const Cell* cell) const
+{
+    if (!m_blocks.count(Allocator::blockFor(cell)))
+        return false;
+    return Allocator::isCellAddress(cell) && !Allocator::isFree(cell);
+}
+
+void Heap::registerBlock(Allocator::Header* block)
+{
+    m_blocks.emplace(block);
+}
+
+void Heap::unregisterBlock(Allocator::Header* block)
 {
+    m_blocks.erase(block);
 }
 
 void Heap::addRoot(Cell* cell)
@@ -65,15 +158,161 @@ void Heap::removeRoot(Cell* cell)
     m_roots.erase(it);
 }
 
+void Heap::remember(const Cell* cell)
+{
+    if (!Allocator::testAndSetRemembered(cell))
+        cell->vm().heap.m_rememberedSet.emplace_back(cell);
+}
+
+Heap::WriteBarrier::WriteBarrier(const Cell* cell)
+    : m_cell(cell)
+{
+    Heap& heap = cell->vm().heap;
+    if (!heap.m_isMarkingConcurrently)
+        return;
+
+    m_cellLock = std::unique_lock<std::mutex>(heap.m_cellLock);
+    heap.trace(heap.m_visitor, cell);
+}
+
+Heap::WriteBarrier::~WriteBarrier()
+{
+    // Everything the cell points to once marking is done will be marked, so
+    // there's nothing to remember.
+    if (m_cellLock.owns_lock())
+        return;
+    writeBarrier(m_cell);
+}
+
+CollectionScope Heap::nextCollectionScope() const
+{
+    // Only go through the whole heap once the old generation has doubled
+    // since the last full collection.
+    if (m_oldCells >= 2 * m_oldCellsAfterFullCollection)
+        return CollectionScope::Full;
+    return CollectionScope::Eden;
+}
+
 void Heap::collect()
+{
+    if (m_isMarkingConcurrently)
+        finishConcurrentCollection();
+    else
+        collect(nextCollectionScope());
+}
+
+void Heap::collect(CollectionScope scope)
 {
     if (std::getenv("NO_GC"))
         return;
 
+    prepareForMarking(scope);
     markFromRoots();
+    mark();
+    finishCollection();
+}
+
+void Heap::triggerCollection()
+{
+    if (!m_usesConcurrentMarking)
+        collect();
+    else if (!m_isMarkingConcurrently) {
+        startConcurrentCollection();
+        m_collectionTrigger = m_allocationBudget;
+    } else
+        finishConcurrentCollection();
+}
+
+// Only pause the mutator to push the roots, the marking threads trace from
+// them while the mutator keeps running.
+void Heap::startConcurrentCollection()
+{
+    auto start = std::chrono::steady_clock::now();
+    prepareForMarking(nextCollectionScope());
+    m_isMarkingConcurrently = true;
+    eachAllocator([&](Allocator& allocator) {
+        allocator.setAllocatesBlack(true);
+        return IterationResult::Continue;
+    });
+    markFromRoots();
+    startMarkingThreads(m_markStacks.size() - 1);
+    LOG(GC, "Started concurrent marking, paused for " << microsecondsSince(start) << "us");
+}
+
+// The write barrier might have pushed more cells since the marking threads
+// ran out of work, so they are drained with the mutator stopped.
+void Heap::finishConcurrentCollection()
+{
+    auto start = std::chrono::steady_clock::now();
+    waitForMarkingThreads();
+    m_isMarkingConcurrently = false;
+    eachAllocator([&](Allocator& allocator) {
+        allocator.setAllocatesBlack(false);
+        return IterationResult::Continue;
+    });
+    mark();
+    finishCollection();
+    LOG(GC, "Finished concurrent marking, paused for " << microsecondsSince(start) << "us");
+}
+
+void Heap::prepareForMarking(CollectionScope scope)
+{
+    m_collectionScope = scope;
+    m_visitor.m_markedCells = 0;
+    m_visitor.m_storageBytes = 0;
+    m_visitedStorageBytes = 0;
+    std::fill(m_markedCellsPerThread.begin(), m_markedCellsPerThread.end(), 0);
+    eachAllocator([&](Allocator& allocator) {
+        allocator.prepareForMarking(scope);
+        return IterationResult::Continue;
+    });
+    if (scope == CollectionScope::Full)
+        m_rememberedSet.clear();
+}
+
+void Heap::finishCollection()
+{
     sweep();
+
+    m_markedCellsPerThread[0] = m_visitor.m_markedCells;
+    m_markedCells = 0;
+    for (size_t markedCells : m_markedCellsPerThread)
+        m_markedCells += markedCells;
+    if (LOG_CHANNEL_ENABLED(GC)) {
+        std::stringstream markedCellsPerThread;
+        for (size_t markedCells : m_markedCellsPerThread)
+            markedCellsPerThread << " " << markedCells;
+        LOG(GC, "Marked cells per thread:" << markedCellsPerThread.str());
+    }
+
+    CollectionScope scope = m_collectionScope;
+    // Eden collections don't visit old cells, so their storage is as big as
+    // when they were last visited.
+    m_visitedStorageBytes += m_visitor.m_storageBytes;
+    if (scope == CollectionScope::Full)
+        m_oldStorageBytes = m_visitedStorageBytes;
+    else
+        m_oldStorageBytes += m_visitedStorageBytes;
+    size_t liveBytes = m_oldStorageBytes;
+    for (const auto& pair : m_allocators)
+        liveBytes += pair.second->liveCellCount() * pair.second->cellSize();
+    size_t heapSize = static_cast<size_t>(liveBytes / m_options.targetUtilization);
+    heapSize = std::min(std::max(heapSize, m_options.minHeapSize), m_options.maxHeapSize);
+    m_allocationBudget = std::max(heapSize > liveBytes ? heapSize - liveBytes : 0, Allocator::s_blockSize);
+    m_collectionTrigger = collectionTrigger(m_allocationBudget);
+    m_bytesAllocated = 0;
+    LOG(GC, "Live bytes: " << liveBytes / 1024 << "KB, next collection after allocating " << m_allocationBudget / 1024 << "KB");
+
+    if (scope == CollectionScope::Full) {
+        m_oldCells = m_markedCells;
+        m_oldCellsAfterFullCollection = m_markedCells;
+    } else
+        m_oldCells += m_markedCells;
+    LOG(GC, (scope == CollectionScope::Full ? "Full" : "Eden") << " collection: marked " << m_markedCells << " cells, " << m_oldCells << " old cells, " << m_allocatedCells << " cells allocated so far, heap size: " << size() / 1024 << "KB");
 }
 
+// All the roots are pushed onto the main thread's mark stack first, so that
+// the marking threads can share the work of tracing from them.
 void Heap::markFromRoots()
 {
     for (Cell* root : m_roots)
@@ -81,14 +320,13 @@ void Heap::markFromRoots()
 
     m_vm->visit(m_visitor);
     markNativeStack();
-    mark();
     markInterpreterStack();
+    markRememberedSet();
 }
 
 void Heap::markRoot(Value root)
 {
     m_visitor.visit(root);
-    mark();
 }
 
 void Heap::markNativeStack()
@@ -107,43 +345,147 @@ void Heap::markInterpreterStack()
         markRoot(value);
 }
 
-void Heap::sweep()
+// Old cells are already marked, so the remembered ones have to be visited
+// explicitly for the young cells they point to to be reached.
+void Heap::markRememberedSet()
 {
-    Allocator::each([&](Allocator& allocator) {
-        allocator.each([&](Cell* cell) {
-            if (isMarked(cell)) {
-                clearMarked(cell);
-                return;
-            }
+    for (const Cell* cell : m_rememberedSet) {
+        Allocator::clearRemembered(cell);
+        cell->visit(m_visitor);
+    }
+    m_rememberedSet.clear();
+}
 
-            cell->~Cell();
-            allocator.free(cell);
-        });
+// Sweeping is lazy: the allocators only take note of how many cells were freed
+// here and destroy the dead cells of a block once they allocate into it.
+void Heap::sweep()
+{
+    eachAllocator([&](Allocator& allocator) {
+        allocator.startSweeping();
         return IterationResult::Continue;
     });
 }
 
 void Heap::mark()
 {
-    while (!m_worklist.empty()) {
-        Cell* cell = m_worklist.front();
-        m_worklist.pop();
+    if (m_markStacks.size() == 1) {
+        drain(m_visitor, 0);
+        return;
+    }
 
-        cell->visit(m_visitor);
+    startMarkingThreads(m_markStacks.size());
+    drain(m_visitor, 0);
+    waitForMarkingThreads();
+}
+
+// Visit cells until every mark stack is empty and every marking thread ran out of work
+void Heap::drain(const Visitor& visitor, unsigned index)
+{
+    auto visit = [&](Cell* cell) {
+        if (m_isMarkingConcurrently) {
+            std::lock_guard<std::mutex> lock(m_cellLock);
+            trace(visitor, cell);
+        } else
+            trace(visitor, cell);
+    };
+
+    MarkStack& markStack = m_markStacks[index];
+    while (true) {
+        while (Cell* cell = markStack.pop())
+            visit(cell);
+
+        if (m_markStacks.size() == 1)
+            return;
+
+        if (Cell* cell = steal(index)) {
+            visit(cell);
+            continue;
+        }
+
+        // Only threads with a non-empty mark stack can find more work, so once
+        // every thread is idle we are done.
+        ++m_idleMarkers;
+        while (true) {
+            if (m_idleMarkers == m_markers)
+                return;
+            bool hasWork = std::any_of(m_markStacks.begin(), m_markStacks.end(), [](const MarkStack& markStack) {
+                return !markStack.isEmpty();
+            });
+            if (hasWork) {
+                --m_idleMarkers;
+                break;
+            }
+            std::this_thread::yield();
+        }
     }
 }
 
-bool Heap::isMarked(Cell* cell)
+// While marking concurrently, the write barrier also traces cells, so a cell
+// might have been traced by the mutator by the time it's popped.
+void Heap::trace(const Visitor& visitor, const Cell* cell)
 {
-    return cell->m_isMarked;
+    if (!Allocator::testAndSetTraced(cell))
+        cell->visit(visitor);
 }
 
-void Heap::setMarked(Cell* cell)
+Cell* Heap::steal(unsigned index)
 {
-    cell->m_isMarked = true;
+    for (unsigned i = 1; i < m_markStacks.size(); ++i) {
+        if (Cell* cell = m_markStacks[(index + i) % m_markStacks.size()].steal())
+            return cell;
+    }
+    return nullptr;
+}
+
+// Wake up the helper threads, with `markers` counting every thread that will be draining
+void Heap::startMarkingThreads(unsigned markers)
+{
+    if (m_markingThreads.empty()) {
+        for (unsigned i = 1; i < m_markStacks.size(); ++i)
+            m_markingThreads.emplace_back([this, i] { markingThreadMain(i); });
+    }
+
+    m_markers = markers;
+    m_idleMarkers = 0;
+    {
+        std::lock_guard<std::mutex> lock(m_markingLock);
+        m_finishedMarkingThreads = 0;
+        ++m_markingEpoch;
+    }
+    m_markingCondition.notify_all();
 }
 
-void Heap::clearMarked(Cell* cell)
+void Heap::waitForMarkingThreads()
 {
-    cell->m_isMarked = false;
+    std::unique_lock<std::mutex> lock(m_markingLock);
+    m_markingFinishedCondition.wait(lock, [&] {
+        return m_finishedMarkingThreads == m_markingThreads.size();
+    });
+}
+
+void Heap::markingThreadMain(unsigned index)
+{
+    Visitor visitor(*this, m_markStacks[index]);
+    uint64_t epoch = 0;
+    while (true) {
+        {
+            std::unique_lock<std::mutex> lock(m_markingLock);
+            m_markingCondition.wait(lock, [&] {
+                return m_isShuttingDown || m_markingEpoch != epoch;
+            });
+            if (m_isShuttingDown)
+                return;
+            epoch = m_markingEpoch;
+        }
+
+        drain(visitor, index);
+        m_markedCellsPerThread[index] += visitor.m_markedCells;
+        visitor.m_markedCells = 0;
+
+        std::lock_guard<std::mutex> lock(m_markingLock);
+        m_visitedStorageBytes += visitor.m_storageBytes;
+        visitor.m_storageBytes = 0;
+        if (++m_finishedMarkingThreads == m_markingThreads.size())
+            m_markingFinishedCondition.notify_one();
+    }
 }
@@ -1,8 +1,17 @@
 #pragma once
 
 #include "Allocator.h"
-#include <queue>
+#include "MarkStack.h"
+#include "StorageSpace.h"
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <thread>
 #include <unordered_map>
+#include <unordered_set>
 
 class Cell;
 class Heap;
@@ -14,10 +23,13 @@ class Visitor {
 
 public:
     void visit(Value) const;
+    // Called by cells with out-of-line storage, so that the heap knows how much of it is live
+    void reportStorage(size_t bytes) const { m_storageBytes += bytes; }
 
 private:
-    Visitor(Heap& heap)
+    Visitor(Heap& heap, MarkStack& markStack)
         : m_heap(heap)
+        , m_markStack(markStack)
     {
     }
 
@@ -26,45 +38,221 @@ private:
     void visitCell(Cell*) const;
 
     Heap& m_heap;
+    MarkStack& m_markStack;
+    mutable size_t m_markedCells { 0 };
+    mutable size_t m_storageBytes { 0 };
+};
+
+// How big a heap can grow before it's collected. An embedder passes these to
+// the VM, and `reach` exposes them as command line options.
+struct HeapOptions {
+    // The heap can grow up to this size without ever collecting
+    size_t minHeapSize { 1 << 20 };
+    // Collect rather than grow past this size, failing if that doesn't free enough
+    size_t maxHeapSize { std::numeric_limits<size_t>::max() };
+    // The fraction of the heap that should be live after a collection: it can
+    // allocate (1 / targetUtilization - 1) times the live size before the next one.
+    double targetUtilization { 0.5 };
 };
 
 class Heap {
+    friend class Allocator;
     friend class Visitor;
 
 public:
-    Heap(VM*);
+    Heap(VM*, const HeapOptions&);
+    ~Heap();
 
     template<typename CellType>
     void* allocate()
     {
-		Allocator& allocator = Allocator::forSize(m_vm, sizeof(CellType));
+		Allocator& allocator = allocatorForSize(sizeof(CellType));
+		if (m_bytesAllocated >= m_collectionTrigger)
+			triggerCollection();
+		m_bytesAllocated += sizeof(CellType);
+		m_allocatedCells++;
 		void* cell = allocator.cell();
 		if (cell)
 			return cell;
 
-		collect();
+		// Collections are driven by the bytes allocated, so the size class just
+		// grows, unless that would take the heap past its maximum size.
+		if (size() + Allocator::s_blockSize <= m_options.maxHeapSize)
+			allocator.addBlock();
+		else
+			collect();
 		cell = allocator.cell();
 		ASSERT(cell, "OOM: failed to allocate");
 		return cell;
     }
 
+    // Storage allocations count towards the next collection, but never trigger
+    // it, since the cell that owns the storage might be halfway through a change.
+    void* allocateStorage(size_t size)
+    {
+        m_bytesAllocated += size;
+        return m_storage.allocate(size);
+    }
+
+    void freeStorage(void* storage, size_t size) { m_storage.free(storage, size); }
+
+    // Bytes held by the heap: cell blocks plus out-of-line storage
+    size_t size() const;
+
     void addRoot(Cell*);
     void removeRoot(Cell*);
 
+    // Must wrap every change to the references held by a cell:
+    //
+    //     Heap::WriteBarrier barrier(this);
+    //     m_items[index] = item;
+    //
+    // While marking concurrently, the cells `cell` referenced when marking
+    // started are visited before its first change (snapshot-at-the-beginning),
+    // and the cell lock is held so the marking threads never see it halfway
+    // through a change. Otherwise, the cell is remembered once the change is done.
+    class WriteBarrier {
+    public:
+        WriteBarrier(const Cell*);
+        ~WriteBarrier();
+
+    private:
+        const Cell* m_cell;
+        std::unique_lock<std::mutex> m_cellLock;
+    };
+
+    void eachAllocator(const std::function<IterationResult(Allocator&)>&);
+
+    // Whether `cell` is the address of an allocated cell in this heap
+    bool contains(const Cell*) const;
+
 private:
+    void registerBlock(Allocator::Header*);
+    void unregisterBlock(Allocator::Header*);
+
+    // Eden collections don't trace through old cells, so old cells that might
+    // now point to young ones are recorded in the remembered set.
+    static void writeBarrier(const Cell* cell)
+    {
+        if (Allocator::isMarked(cell))
+            remember(cell);
+    }
+    static void remember(const Cell*);
+
+    Allocator& allocatorForSize(size_t);
+    CollectionScope nextCollectionScope() const;
     void collect();
+    void collect(CollectionScope);
+    void triggerCollection();
+    void startConcurrentCollection();
+    void finishConcurrentCollection();
+    void prepareForMarking(CollectionScope);
+    void finishCollection();
     void markFromRoots();
     void markRoot(Value);
     void markNativeStack();
     void markInterpreterStack();
+    void markRememberedSet();
     void sweep();
     void mark();
-    bool isMarked(Cell*);
-    void setMarked(Cell*);
-    void clearMarked(Cell*);
+    void drain(const Visitor&, unsigned);
+    void trace(const Visitor&, const Cell*);
+    Cell* steal(unsigned);
+    void startMarkingThreads(unsigned);
+    void waitForMarkingThreads();
+    void markingThreadMain(unsigned);
 
     VM* m_vm;
+    HeapOptions m_options;
+    // One mark stack per marking thread, the first one belongs to the main thread
+    std::deque<MarkStack> m_markStacks;
     Visitor m_visitor;
-    std::queue<Cell*> m_worklist;
     std::vector<Cell*> m_roots;
+    std::vector<const Cell*> m_rememberedSet;
+
+    CollectionScope m_collectionScope { CollectionScope::Full };
+    size_t m_markedCells { 0 };
+    // Cells that survived a collection, and how many of them there were right
+    // after the last full collection.
+    size_t m_oldCells { 0 };
+    size_t m_oldCellsAfterFullCollection { 0 };
+    // Storage reported by the cells visited by the marking threads, and by old cells
+    size_t m_visitedStorageBytes { 0 };
+    size_t m_oldStorageBytes { 0 };
+    // Must outlive the allocators, since destroying cells frees their storage
+    StorageSpace m_storage;
+
+    // Bytes of cells and storage allocated since the last collection, and how
+    // many of them can be allocated before the next one.
+    size_t m_bytesAllocated { 0 };
+    size_t m_allocationBudget;
+    // Cells allocated since the VM started, for the GC log
+    size_t m_allocatedCells { 0 };
+    // Reaching this starts the next collection: with concurrent marking, that
+    // happens before the budget is used up so that marking can finish in time.
+    size_t m_collectionTrigger;
+    std::unordered_map<size_t, std::unique_ptr<Allocator>> m_allocators;
+    // Every block owned by one of the allocators above
+    std::unordered_set<Allocator::Header*> m_blocks;
+
+    // Helper threads for marking, started on the first collection
+    std::vector<std::thread> m_markingThreads;
+    std::vector<size_t> m_markedCellsPerThread;
+    std::mutex m_markingLock;
+    std::condition_variable m_markingCondition;
+    std::condition_variable m_markingFinishedCondition;
+    uint64_t m_markingEpoch { 0 };
+    unsigned m_finishedMarkingThreads { 0 };
+    bool m_isShuttingDown { false };
+    // The threads draining the mark stacks: the main thread is only one of
+    // them when the mutator is stopped.
+    unsigned m_markers { 1 };
+    std::atomic<unsigned> m_idleMarkers { 0 };
+
+    bool m_usesConcurrentMarking;
+    bool m_isMarkingConcurrently { false };
+    // Held by the marking threads while visiting a cell during concurrent
+    // marking, and by the mutator while changing one.
+    std::mutex m_cellLock;
+};
+
+// Allocates the payload of a cell (e.g. `std::vector<Value, StorageAllocator<Value>>`)
+// from the heap's storage space.
+template<typename T>
+class StorageAllocator {
+    template<typename U>
+    friend class StorageAllocator;
+
+public:
+    using value_type = T;
+
+    StorageAllocator(Heap& heap)
+        : m_heap(&heap)
+    {
+    }
+
+    template<typename U>
+    StorageAllocator(const StorageAllocator<U>& other)
+        : m_heap(other.m_heap)
+    {
+    }
+
+    T* allocate(size_t count)
+    {
+        return static_cast<T*>(m_heap->allocateStorage(count * sizeof(T)));
+    }
+
+    void deallocate(T* storage, size_t count)
+    {
+        m_heap->freeStorage(storage, count * sizeof(T));
+    }
+
+    template<typename U>
+    bool operator==(const StorageAllocator<U>& other) const { return m_heap == other.m_heap; }
+
+    template<typename U>
+    bool operator!=(const StorageAllocator<U>& other) const { return m_heap != other.m_heap; }
+
+private:
+    Heap* m_heap;
 };
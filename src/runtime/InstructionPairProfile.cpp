@@ -0,0 +1,41 @@
+#include "InstructionPairProfile.h"
+
+#include <algorithm>
+#include <iomanip>
+#include <vector>
+
+void InstructionPairProfile::record(Instruction::ID id)
+{
+    if (m_previous)
+        m_counts[*m_previous][id]++;
+    m_previous = id;
+    m_dispatches++;
+}
+
+void InstructionPairProfile::dump(std::ostream& out, size_t count) const
+{
+    struct Pair {
+        uint64_t count;
+        Instruction::ID first;
+        Instruction::ID second;
+    };
+
+    std::vector<Pair> pairs;
+    for (uint32_t first = 0; first < INSTRUCTION_COUNT; first++) {
+        for (uint32_t second = 0; second < INSTRUCTION_COUNT; second++) {
+            if (m_counts[first][second])
+                pairs.push_back(Pair { m_counts[first][second], static_cast<Instruction::ID>(first), static_cast<Instruction::ID>(second) });
+        }
+    }
+    std::sort(pairs.begin(), pairs.end(), [](const Pair& a, const Pair& b) {
+        return a.count > b.count;
+    });
+    pairs.resize(std::min(pairs.size(), count));
+
+    out << "Instruction pairs, out of " << m_dispatches << " dispatches:" << std::endl;
+    for (const Pair& pair : pairs) {
+        out << std::setw(12) << pair.count
+            << std::setw(7) << std::fixed << std::setprecision(2) << 100.0 * pair.count / m_dispatches << "%  "
+            << Instruction::name(pair.first) << " -> " << Instruction::name(pair.second) << std::endl;
+    }
+}
@@ -0,0 +1,22 @@
+#pragma once
+
+#include "Instruction.h"
+#include <iostream>
+#include <optional>
+#include <stdint.h>
+
+// Counts how often each instruction is dispatched right after each other one,
+// to find the sequences that are worth fusing into a superinstruction. Only
+// the interpreter records into it, so the JIT stays off while profiling.
+class InstructionPairProfile {
+public:
+    void record(Instruction::ID);
+
+    // Prints the `count` most frequent pairs
+    void dump(std::ostream&, size_t count = 20) const;
+
+private:
+    std::optional<Instruction::ID> m_previous;
+    uint64_t m_dispatches { 0 };
+    uint64_t m_counts[INSTRUCTION_COUNT][INSTRUCTION_COUNT] { };
+};
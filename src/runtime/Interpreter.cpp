@@ -3,29 +3,36 @@
 #include "Array.h"
 #include "Function.h"
 #include "Hole.h"
+#include "InstructionPairProfile.h"
 #include "Log.h"
+#include "NumericOperators.h"
 #include "Object.h"
 #include "Scope.h"
 #include "Tuple.h"
 #include "Type.h"
 #include "UnificationScope.h"
+#include <algorithm>
 #include <sstream>
+#include <string.h>
 
+// The type checking code of a block only runs once: type errors exit before
+// it returns, so it's no longer needed afterwards.
 Value Interpreter::check(VM& vm, BytecodeBlock& block, Environment* parentEnvironment)
 {
-    LOG(InterpreterDispatch, "Checking " << block.name() << " @ " << block.locationInfo(0));
-    Interpreter interpreter { vm, block, 0, parentEnvironment };
-    interpreter.m_mode = Mode::Check;
+    ASSERT(block.instructions(Mode::Check).size(), "Block was already checked: %s", block.name().c_str());
+    LOG(InterpreterDispatch, "Checking " << block.name() << " @ " << block.locationInfo(0, Mode::Check));
+    Interpreter interpreter { vm, block, Mode::Check, parentEnvironment };
     Value result = interpreter.run();
-    LOG(InterpreterDispatch, "Done checking " << block.name() << ": " << result << " @ " << block.locationInfo(0));
+    LOG(InterpreterDispatch, "Done checking " << block.name() << ": " << result << " @ " << block.locationInfo(0, Mode::Check));
+    block.releaseCheckCode();
     return result;
 }
 
-Value Interpreter::run(VM& vm, BytecodeBlock& block, Environment* parentEnvironment, const Values& args, const Callback& callback)
+Value Interpreter::run(VM& vm, BytecodeBlock& block, Environment* parentEnvironment, const Value* args, uint32_t argc, const Callback& callback)
 {
     LOG(InterpreterDispatch, "Running " << block.name() << " @ " << block.locationInfo(0));
-    Interpreter interpreter { vm, block, block.codeStart(), parentEnvironment };
-    Value result = interpreter.run(args, callback);
+    Interpreter interpreter { vm, block, Mode::Run, parentEnvironment };
+    Value result = interpreter.run(args, argc, callback);
     LOG(InterpreterDispatch, "Done running " << block.name() << ": " << result << " @ " << block.locationInfo(0));
     return result;
 }
@@ -35,15 +42,20 @@ Value& Interpreter::Stack::operator[](const Register& reg) const
     return m_stackAddress[reg.offset()];
 }
 
-Interpreter::Interpreter(VM& vm, BytecodeBlock& block, InstructionStream::Offset bytecodeOffset, Environment* parentEnvironment)
+Interpreter::Interpreter(VM& vm, BytecodeBlock& block, Mode mode, Environment* parentEnvironment)
     : m_vm(vm)
-    , m_block(block)
-    , m_ip(m_block.instructions().at(bytecodeOffset))
+    , m_block(&block)
+    , m_mode(mode)
+    , m_ip(m_block->instructions(mode).at(0))
     , m_result(Value::crash())
 {
     m_lastBlock = vm.currentBlock;
+    m_wasCheckingLastBlock = vm.isCheckingCurrentBlock;
     m_vm.currentBlock = &block;
-    m_environment = Environment::create(vm, parentEnvironment ?: vm.globalEnvironment);
+    m_vm.isCheckingCurrentBlock = mode == Mode::Check;
+    m_environment = parentEnvironment ?: vm.globalEnvironment;
+    if (mode == Mode::Check || block.needsEnvironment())
+        m_environment = Environment::create(vm, m_environment);
     m_lastInterpreter = m_vm.currentInterpreter;
     m_vm.currentInterpreter = this;
 }
@@ -51,126 +63,242 @@ Interpreter::Interpreter(VM& vm, BytecodeBlock& block, InstructionStream::Offset
 Interpreter::~Interpreter()
 {
     m_vm.currentBlock = m_lastBlock;
+    m_vm.isCheckingCurrentBlock = m_wasCheckingLastBlock;
     m_vm.currentInterpreter = m_lastInterpreter;
 }
 
 void Interpreter::visit(const Visitor& visitor) const
 {
-    visitor.visit(&m_block);
+    visitor.visit(m_block);
     visitor.visit(m_environment);
+    for (const CallFrame& frame : m_callFrames) {
+        visitor.visit(frame.block);
+        visitor.visit(frame.environment);
+    }
     visitor.visit(m_lastInterpreter);
     if (m_lastInterpreter)
         m_lastInterpreter->visit(visitor);
 }
 
-Value Interpreter::run(const Values& args, const Callback& callback)
+Value Interpreter::run(const Value* args, uint32_t argc, const Callback& callback)
 {
-    size_t initialStackSize = m_vm.stack.size();
-    m_vm.stack.insert(m_vm.stack.begin(), args.begin(), args.end());
+    Value* initialTop = m_vm.stack.begin();
+    Value* frame = pushRegisters(argc + 1, m_ip.offset());
 
     // fill what would be the return address
-    m_vm.stack.insert(m_vm.stack.begin(), Value::crash());
+    frame[0] = Value::crash();
+    std::copy(args, args + argc, frame + 1);
 
     m_callback = callback;
-    m_stop = false;
-    while (!m_stop) {
-        m_stop = true;
-        dispatch();
-    }
+    execute(argc);
 
-    m_vm.stack.erase(m_vm.stack.begin(), m_vm.stack.begin() + args.size() + 1);
-    ASSERT(m_vm.stack.size() == initialStackSize, "Inconsistent stack");
+    ASSERT(m_vm.stack.begin() == initialTop, "Inconsistent stack");
     return m_result;
 }
 
-void Interpreter::dispatch()
+Value* Interpreter::pushRegisters(size_t count, InstructionStream::Offset bytecodeOffset)
 {
-#define CASE(Instruction) \
-    case Instruction::ID: { \
-        const Instruction* instruction = reinterpret_cast<const Instruction*>(m_ip.get()); \
-        LOG(InterpreterDispatch, m_block.name() << "#" << m_ip.offset() << ": " << *instruction << " @ " << m_block.locationInfo(m_ip.offset())); \
-        run##Instruction(*instruction); \
-        break; \
-    } \
-
-    switch (m_ip->id) {
-        FOR_EACH_INSTRUCTION(CASE)
-    }
-
-#undef CASE
+    Value* registers = m_vm.stack.push(count);
+    if (!registers)
+        m_vm.runtimeError(bytecodeOffset, "Stack overflow");
+    return registers;
 }
 
-template<typename Functor>
-Value Interpreter::preserveStack(const Functor& functor)
+static const uint32_t* instructionsStart(const BytecodeBlock& block, BytecodeBlock::Code code)
 {
-    size_t stackSize = vm().stack.size();
-    uint32_t cfrIndex = m_cfr.m_stackAddress - &vm().stack[0];
-    auto result = functor();
-    ASSERT(vm().stack.size() == stackSize, "Inconsistent stack");
-    m_cfr = Stack { &vm().stack[cfrIndex] };
-    return result;
+    return reinterpret_cast<const uint32_t*>(block.instructions(code).at(0).get());
 }
 
+// The callee's Enter has no location of its own, so running out of registers
+// there is reported at the call that led to it, if this interpreter made it
+void Interpreter::stackOverflowInCallee(InstructionStream::Offset bytecodeOffset)
+{
+    if (!m_callFrames.empty()) {
+        const CallFrame& caller = m_callFrames.back();
+        m_vm.currentBlock = caller.block;
+        m_vm.isCheckingCurrentBlock = caller.mode == Mode::Check;
+        bytecodeOffset = reinterpret_cast<const uint32_t*>(caller.pc) - instructionsStart(*caller.block, caller.mode);
+    }
+    m_vm.runtimeError(bytecodeOffset, "Stack overflow");
+}
+
+// Threaded dispatch: every handler ends by jumping straight to the next one
+// through a table of label addresses, a GNU extension. Building with
+// -DCOMPUTED_GOTO=0 falls back to a switch.
+#ifndef COMPUTED_GOTO
+#ifdef __GNUC__
+#define COMPUTED_GOTO 1
+#else
+#define COMPUTED_GOTO 0
+#endif
+#endif
+
+// The body of each handler is the body of an `if`, so that `ip` is scoped to it.
+// Computed gotos don't run destructors, so anything that needs one must live
+// in a nested scope that closes before DISPATCH() or JUMP().
 #define OP(Instruction) \
-    void Interpreter::run##Instruction(const Instruction& ip)
+    op_##Instruction: \
+    if (const Instruction& ip = *reinterpret_cast<const Instruction*>(pc); true)
+
+#define BYTECODE_OFFSET() \
+    static_cast<InstructionStream::Offset>(reinterpret_cast<const uint32_t*>(pc) - codeStart)
+
+#define TRACE() \
+    LOG(InterpreterDispatch, m_block->name() << "#" << BYTECODE_OFFSET() << ": " << *pc << " @ " << m_block->locationInfo(BYTECODE_OFFSET(), m_mode))
+
+#if COMPUTED_GOTO
+#define NEXT() goto *dispatchTable[pc->id]
+#else
+#define NEXT() goto dispatch
+#endif
 
 #define DISPATCH() \
     do { \
-        m_ip.operator++(); \
-        m_stop = false; \
-        return; \
+        pc = reinterpret_cast<const Instruction*>(&ip + 1); \
+        NEXT(); \
     } while (false)
 
 #define JUMP(__target) \
     do { \
-        m_ip += __target; \
-        m_stop = false; \
-        return; \
+        pc = reinterpret_cast<const Instruction*>(reinterpret_cast<const uint32_t*>(pc) + __target); \
+        NEXT(); \
     } while (false)
 
+void Interpreter::execute(uint32_t argc)
+{
+    const uint32_t* codeStart = instructionsStart(*m_block, m_mode);
+    const Instruction* pc = m_ip.get();
+    Stack cfr { nullptr };
+    bool tracing = LOG_CHANNEL_ENABLED(InterpreterDispatch);
+    InstructionPairProfile* profile = m_vm.instructionPairProfile;
+
+#if COMPUTED_GOTO
+#define LABEL_ADDRESS(Instruction) &&op_##Instruction,
+#define INSTRUMENT_ADDRESS(Instruction) &&instrument,
+    static const void* const opcodeTable[] = { FOR_EACH_INSTRUCTION(LABEL_ADDRESS) };
+    // While tracing or profiling, every instruction goes through `instrument`
+    // on its way to its handler
+    static const void* const instrumentedTable[] = { FOR_EACH_INSTRUCTION(INSTRUMENT_ADDRESS) };
+#undef INSTRUMENT_ADDRESS
+#undef LABEL_ADDRESS
+
+    const void* const* dispatchTable = tracing || profile ? instrumentedTable : opcodeTable;
+    NEXT();
+
+instrument:
+    if (tracing)
+        TRACE();
+    if (profile)
+        profile->record(pc->id);
+    goto *opcodeTable[pc->id];
+#else
+dispatch:
+    if (tracing)
+        TRACE();
+    if (profile)
+        profile->record(pc->id);
+
+#define CASE(Instruction) \
+    case Instruction::ID: \
+        goto op_##Instruction;
+
+    switch (pc->id) {
+        FOR_EACH_INSTRUCTION(CASE)
+    }
+    ASSERT_NOT_REACHED();
+    return;
+
+#undef CASE
+#endif
+
 OP(Enter)
 {
     UNUSED(ip);
-    m_vm.stack.insert(m_vm.stack.begin(), m_block.numLocals(), Value::crash());
-    m_cfr = Stack { &vm().stack[m_block.numLocals()] };
+    uint32_t numLocals = m_block->numLocals(m_mode);
+    Value* locals = m_vm.stack.push(numLocals);
+    if (!locals)
+        stackOverflowInCallee(BYTECODE_OFFSET());
+    std::fill(locals, locals + numLocals, Value::crash());
+    cfr = Stack { locals + numLocals };
     DISPATCH();
 }
 
 OP(End)
 {
-    m_result = m_cfr[ip.dst];
-    if (m_callback)
-        m_callback(*this);
-    m_vm.stack.erase(m_vm.stack.begin(), m_vm.stack.begin() + m_block.numLocals());
+    // Pop the locals, arguments and return slot
+    if (m_callFrames.empty()) {
+        m_result = cfr[ip.value];
+        if (m_callback)
+            m_callback(*this);
+        m_vm.stack.pop(m_block->numLocals(m_mode) + argc + 1);
+        return;
+    }
+
+    // Return to the caller
+    Value result = cfr[ip.value];
+    CallFrame caller = m_callFrames.back();
+    m_callFrames.pop_back();
+    const Call& call = *reinterpret_cast<const Call*>(caller.pc);
+    m_vm.stack.pop(m_block->numLocals(m_mode) + argc + 1);
+    argc = caller.argc;
+    m_block = caller.block;
+    m_environment = caller.environment;
+    m_mode = caller.mode;
+    m_vm.currentBlock = m_block;
+    m_vm.isCheckingCurrentBlock = m_mode == Mode::Check;
+    codeStart = instructionsStart(*m_block, m_mode);
+    cfr = caller.cfr;
+    cfr[call.dst] = result;
+    pc = reinterpret_cast<const Instruction*>(&call + 1);
+    NEXT();
 }
 
 OP(Move)
 {
-    m_cfr[ip.dst] = m_cfr[ip.src];
+    cfr[ip.dst] = cfr[ip.src];
     DISPATCH();
 }
 
 OP(LoadConstant)
 {
-    m_cfr[ip.dst] = m_block.constant(ip.constantIndex);
+    cfr[ip.dst] = m_block->constant(ip.constantIndex);
     DISPATCH();
 }
 
 OP(StoreConstant)
 {
-    m_block.constant(ip.constantIndex) = m_cfr[ip.value];
+    {
+        Heap::WriteBarrier barrier(m_block);
+        m_block->constant(ip.constantIndex) = cfr[ip.value];
+    }
     DISPATCH();
 }
 
 OP(GetLocal)
 {
     bool success;
-    const std::string& variable = m_block.identifier(ip.identifierIndex);
-    m_cfr[ip.dst] = m_environment->get(variable, success);
+    const std::string& variable = m_block->identifier(ip.identifierIndex);
+    cfr[ip.dst] = m_environment->get(variable, success);
     if (!success) {
         std::stringstream message;
         message << "Unknown variable: `" << variable << "`";
-        m_vm.typeError(m_ip.offset(), message.str());
+        m_vm.typeError(BYTECODE_OFFSET(), message.str());
+    }
+    DISPATCH();
+}
+
+OP(GetGlobal)
+{
+    cfr[ip.dst] = m_vm.globalCell(ip.cellIndex).value;
+    if (cfr[ip.dst].bits() == Value::crash().bits()) {
+        bool success;
+        const std::string& variable = m_block->identifier(ip.identifierIndex);
+        cfr[ip.dst] = m_environment->get(variable, success);
+        if (!success) {
+            std::stringstream message;
+            message << "Unknown variable: `" << variable << "`";
+            m_vm.typeError(BYTECODE_OFFSET(), message.str());
+        }
     }
     DISPATCH();
 }
@@ -178,73 +306,92 @@ OP(GetLocal)
 OP(GetLocalOrConstant)
 {
     bool success;
-    const std::string& variable = m_block.identifier(ip.identifierIndex);
-    m_cfr[ip.dst] = m_environment->get(variable, success);
-    if (!success || m_cfr[ip.dst].isAbstractValue())
-        m_cfr[ip.dst] = m_block.constant(ip.constantIndex);
+    const std::string& variable = m_block->identifier(ip.identifierIndex);
+    cfr[ip.dst] = m_environment->get(variable, success);
+    if (!success || cfr[ip.dst].isAbstractValue())
+        cfr[ip.dst] = m_block->constant(ip.constantIndex);
     DISPATCH();
 }
 
 OP(SetLocal)
 {
-    m_environment->set(m_block.identifier(ip.identifierIndex), m_cfr[ip.src]);
+    m_environment->set(m_block->identifier(ip.identifierIndex), cfr[ip.src]);
+    DISPATCH();
+}
+
+OP(GetCapturedVariable)
+{
+    bool success;
+    const std::string& variable = m_block->identifier(ip.identifierIndex);
+    cfr[ip.dst] = m_environment->getCaptured(ip.depth, ip.slot, variable, success);
+    if (!success) {
+        std::stringstream message;
+        message << "Unknown variable: `" << variable << "`";
+        m_vm.typeError(BYTECODE_OFFSET(), message.str());
+    }
+    DISPATCH();
+}
+
+OP(SetCapturedVariable)
+{
+    cfr[ip.function].asCell<Function>()->setCaptured(ip.slot, cfr[ip.src]);
     DISPATCH();
 }
 
 OP(NewArray)
 {
-    Value typeValue = m_cfr[ip.type];
+    Value typeValue = cfr[ip.type];
     auto* type = typeValue.isUnit() ? nullptr : typeValue.asType();
-    m_cfr[ip.dst] = Value { Array::create(vm(), type, ip.initialSize) };
+    cfr[ip.dst] = Value { Array::create(vm(), type, ip.initialSize) };
     DISPATCH();
 }
 
 OP(SetArrayIndex)
 {
-    Array* array = m_cfr[ip.src].asCell<Array>();
-    Value value = m_cfr[ip.value];
+    Array* array = cfr[ip.src].asCell<Array>();
+    Value value = cfr[ip.value];
     array->setIndex(ip.index, value);
     DISPATCH();
 }
 
 OP(GetArrayIndex)
 {
-    Array* array = m_cfr[ip.array].asCell<Array>();
-    Value index = m_cfr[ip.index];
+    Array* array = cfr[ip.array].asCell<Array>();
+    Value index = cfr[ip.index];
     Value result = array->getIndex(index);
-    m_cfr[ip.dst] = result;
+    cfr[ip.dst] = result;
     DISPATCH();
 }
 
 OP(GetArrayLength)
 {
-    Array* array = m_cfr[ip.array].asCell<Array>();
-    m_cfr[ip.dst] = static_cast<uint32_t>(array->size());
+    Array* array = cfr[ip.array].asCell<Array>();
+    cfr[ip.dst] = static_cast<uint32_t>(array->size());
     DISPATCH();
 }
 
 OP(NewTuple)
 {
-    Value typeValue = m_cfr[ip.type];
+    Value typeValue = cfr[ip.type];
     auto* type = typeValue.isUnit() ? nullptr : typeValue.asType();
-    m_cfr[ip.dst] = Value { Tuple::create(vm(), type, ip.initialSize) };
+    cfr[ip.dst] = Value { Tuple::create(vm(), type, ip.initialSize) };
     DISPATCH();
 }
 
 OP(SetTupleIndex)
 {
-    Tuple* tuple = m_cfr[ip.tuple].asCell<Tuple>();
-    Value value = m_cfr[ip.value];
+    Tuple* tuple = cfr[ip.tuple].asCell<Tuple>();
+    Value value = cfr[ip.value];
     tuple->setIndex(ip.index, value);
     DISPATCH();
 }
 
 OP(GetTupleIndex)
 {
-    Tuple* tuple = m_cfr[ip.tuple].asCell<Tuple>();
-    Value index = m_cfr[ip.index];
+    Tuple* tuple = cfr[ip.tuple].asCell<Tuple>();
+    Value index = cfr[ip.index];
     Value result = tuple->getIndex(index);
-    m_cfr[ip.dst] = result;
+    cfr[ip.dst] = result;
     DISPATCH();
 }
 
@@ -253,70 +400,113 @@ OP(NewFunction)
     Function* function;
 
     if (m_mode == Mode::Check) {
-        BytecodeBlock& functionBlock = m_block.functionBlock(ip.functionIndex);
-        Value type = preserveStack([&] {
-            return check(vm(), functionBlock, m_environment);
-        });
+        BytecodeBlock& functionBlock = m_block->functionBlock(ip.functionIndex);
+        Value type = check(vm(), functionBlock, m_environment);
         ASSERT(type.isType(), "OOPS");
         function = Function::create(vm(), functionBlock, m_environment, type.asType());
-        m_block.setFunction(ip.functionIndex, function);
+        m_block->setFunction(ip.functionIndex, function);
     } else {
-        function = m_block.function(ip.functionIndex);
-        function->setParentEnvironment(m_environment);
+        function = m_block->function(ip.functionIndex)->createClosure(vm(), m_environment);
     }
 
-    m_cfr[ip.dst] = Value { function };
+    cfr[ip.dst] = Value { function };
     DISPATCH();
 }
 
 OP(Call)
 {
-    auto* function = m_cfr[ip.callee].asCell<Function>();
-    Values args(ip.argc);
-    uint32_t firstArgOffset = -ip.firstArg.offset();
-    for (uint32_t i = 0; i < ip.argc; i++)
-        args[i] = m_cfr[Register::forLocal(firstArgOffset + i)];
-    auto result = preserveStack([&] {
-        return function->call(vm(), args);
-    });
-    m_cfr[ip.dst] = result;
-    DISPATCH();
+    auto* function = cfr[ip.callee].asCell<Function>();
+    const Value* args = &cfr[ip.firstArg];
+    BytecodeBlock* block = function->interpretedBlock(vm());
+    if (!block) {
+        cfr[ip.dst] = function->call(vm(), args, ip.argc);
+        DISPATCH();
+    }
+
+    // Run the callee in this same loop, with the same frame layout as run():
+    // the return slot and the arguments go right below the caller's registers.
+    Value* frame = pushRegisters(ip.argc + 1, BYTECODE_OFFSET());
+    frame[0] = Value::crash();
+    std::copy(args, args + ip.argc, frame + 1);
+    m_callFrames.push_back(CallFrame { pc, m_block, m_environment, cfr, m_mode, argc });
+    m_environment = function->parentEnvironment() ?: vm().globalEnvironment;
+    if (block->needsEnvironment())
+        m_environment = Environment::create(vm(), m_environment);
+    m_block = block;
+    m_mode = Mode::Run;
+    m_vm.currentBlock = m_block;
+    m_vm.isCheckingCurrentBlock = false;
+    codeStart = instructionsStart(*m_block, m_mode);
+    argc = ip.argc;
+    pc = reinterpret_cast<const Instruction*>(codeStart);
+    NEXT();
+}
+
+OP(TailCall)
+{
+    auto* function = cfr[ip.callee].asCell<Function>();
+    const Value* args = &cfr[ip.firstArg];
+    BytecodeBlock* block = function->interpretedBlock(vm());
+    if (!block) {
+        // The End that follows returns the result
+        cfr[ip.dst] = function->call(vm(), args, ip.argc);
+        DISPATCH();
+    }
+
+    // Allocate before popping our frame, which is all that keeps the callee alive
+    Environment* environment = function->parentEnvironment() ?: vm().globalEnvironment;
+    if (block->needsEnvironment())
+        environment = Environment::create(vm(), environment);
+
+    // Replace our frame with the callee's, moving the arguments over our own
+    m_vm.stack.pop(m_block->numLocals(m_mode) + argc + 1);
+    Value* frame = pushRegisters(ip.argc + 1, BYTECODE_OFFSET());
+    memmove(frame + 1, args, ip.argc * sizeof(Value));
+    frame[0] = Value::crash();
+
+    m_environment = environment;
+    m_block = block;
+    m_vm.currentBlock = m_block;
+    codeStart = instructionsStart(*m_block, m_mode);
+    argc = ip.argc;
+    pc = reinterpret_cast<const Instruction*>(codeStart);
+    NEXT();
 }
 
 OP(NewObject)
 {
-    Value typeValue = m_cfr[ip.type];
+    Value typeValue = cfr[ip.type];
     auto* type = typeValue.isUnit() ? nullptr : typeValue.asType();
     auto* object = Object::create(vm(), type, ip.inlineSize);
-    m_cfr[ip.dst] = Value { object };
+    cfr[ip.dst] = Value { object };
     DISPATCH();
 }
 
 OP(SetField)
 {
-    Object* object = m_cfr[ip.object].asCell<Object>();
-    const std::string& field = m_block.identifier(ip.fieldIndex);
-    Value value = m_cfr[ip.value];
-    object->set(field, value);
+    Object* object = cfr[ip.object].asCell<Object>();
+    const std::string& field = m_block->identifier(ip.fieldIndex);
+    Value value = cfr[ip.value];
+    object->set(field, value, &m_block->fieldCache(ip.cacheIndex));
     DISPATCH();
 }
 
 OP(GetField)
 {
-    Object* object = m_cfr[ip.object].asCell<Object>();
-    const std::string& field = m_block.identifier(ip.fieldIndex);
-    m_cfr[ip.dst] = object->get(field);
+    Object* object = cfr[ip.object].asCell<Object>();
+    const std::string& field = m_block->identifier(ip.fieldIndex);
+    cfr[ip.dst] = object->get(field, &m_block->fieldCache(ip.cacheIndex));
     DISPATCH();
 }
 
 OP(TryGetField)
 {
-    Object* object = m_cfr[ip.object].asCell<Object>();
-    const std::string& field = m_block.identifier(ip.fieldIndex);
-    auto value = object->tryGet(field);
+    Object* object = cfr[ip.object].asCell<Object>();
+    const std::string& field = m_block->identifier(ip.fieldIndex);
+    auto value = object->tryGet(field, &m_block->fieldCache(ip.cacheIndex));
     if (!value)
         JUMP(ip.target);
-    m_cfr[ip.dst] = *value;
+    cfr[ip.dst] = *value;
     DISPATCH();
 }
 
@@ -327,7 +517,7 @@ OP(Jump)
 
 OP(JumpIfFalse)
 {
-    Value condition = m_cfr[ip.condition];
+    Value condition = cfr[ip.condition];
     if (!condition.asBool())
         JUMP(ip.target);
     DISPATCH();
@@ -335,21 +525,88 @@ OP(JumpIfFalse)
 
 OP(IsEqual)
 {
-    m_cfr[ip.dst] = m_cfr[ip.lhs] == m_cfr[ip.rhs];
+    cfr[ip.dst] = cfr[ip.lhs] == cfr[ip.rhs];
     DISPATCH();
 }
 
 OP(RuntimeError)
 {
-    const std::string& message = m_block.identifier(ip.messageIndex);
-    m_vm.runtimeError(m_ip.offset(), message);
+    const std::string& message = m_block->identifier(ip.messageIndex);
+    m_vm.runtimeError(BYTECODE_OFFSET(), message);
     DISPATCH();
 }
 
 OP(IsCell)
 {
-    Value value = m_cfr[ip.value];
-    m_cfr[ip.dst] = value.isCell() && value.asCell()->kind() == ip.kind;
+    Value value = cfr[ip.value];
+    cfr[ip.dst] = value.isCell() && value.asCell()->kind() == ip.kind;
+    DISPATCH();
+}
+
+// Operators on numbers: computed right here while the operator's name still
+// refers to the VM's own function, otherwise a call to whatever it refers to
+#define NUMERIC_OP(Instruction, name, resultType, expression) \
+    OP(Instruction) \
+    { \
+        Value callee = cfr[ip.callee]; \
+        Value lhs = cfr[ip.lhs]; \
+        Value rhs = cfr[ip.rhs]; \
+        if (callee.bits() == Value { m_vm.builtin##Instruction }.bits() && lhs.isNumber() && rhs.isNumber()) \
+            cfr[ip.dst] = numeric##Instruction(lhs.asNumber(), rhs.asNumber()); \
+        else \
+            cfr[ip.dst] = callOperator(m_vm, callee, lhs, rhs); \
+        DISPATCH(); \
+    }
+FOR_EACH_NUMERIC_OPERATOR(NUMERIC_OP)
+#undef NUMERIC_OP
+
+// Superinstructions
+
+OP(GetLocalField)
+{
+    bool success;
+    const std::string& variable = m_block->identifier(ip.identifierIndex);
+    Value value = m_environment->get(variable, success);
+    if (!success) {
+        std::stringstream message;
+        message << "Unknown variable: `" << variable << "`";
+        m_vm.typeError(BYTECODE_OFFSET(), message.str());
+        value = Value::crash();
+    }
+    Object* object = value.asCell<Object>();
+    cfr[ip.dst] = object->get(m_block->identifier(ip.fieldIndex), &m_block->fieldCache(ip.cacheIndex));
+    DISPATCH();
+}
+
+OP(SetFieldToConstant)
+{
+    Object* object = cfr[ip.object].asCell<Object>();
+    const std::string& field = m_block->identifier(ip.fieldIndex);
+    object->set(field, m_block->constant(ip.constantIndex), &m_block->fieldCache(ip.cacheIndex));
+    DISPATCH();
+}
+
+OP(NewObjectOfConstantType)
+{
+    Value typeValue = m_block->constant(ip.constantIndex);
+    auto* type = typeValue.isUnit() ? nullptr : typeValue.asType();
+    auto* object = Object::create(vm(), type, ip.inlineSize);
+    cfr[ip.dst] = Value { object };
+    DISPATCH();
+}
+
+OP(JumpIfNotEqual)
+{
+    if (!(cfr[ip.lhs] == cfr[ip.rhs]))
+        JUMP(ip.target);
+    DISPATCH();
+}
+
+OP(JumpIfNotCellKind)
+{
+    Value value = cfr[ip.value];
+    if (!value.isCell() || value.asCell()->kind() != ip.kind)
+        JUMP(ip.target);
     DISPATCH();
 }
 
@@ -381,11 +638,7 @@ OP(PushUnificationScope)
 OP(PopUnificationScope)
 {
     UNUSED(ip);
-    // This might call a nested interpreter, which might resize the underlying stack storage
-    preserveStack([&] {
-        delete m_vm.unificationScope;
-        return Value::crash();
-    });
+    delete m_vm.unificationScope;
 
     if (!m_vm.unificationScope) {
         // We are done type checking!
@@ -399,29 +652,26 @@ OP(PopUnificationScope)
 
 OP(Unify)
 {
-    m_vm.unificationScope->unify(m_ip.offset(), m_cfr[ip.lhs], m_cfr[ip.rhs]);
+    m_vm.unificationScope->unify(BYTECODE_OFFSET(), cfr[ip.lhs], cfr[ip.rhs]);
     DISPATCH();
 }
 
 OP(Match)
 {
-    m_vm.unificationScope->match(m_ip.offset(), m_cfr[ip.lhs], m_cfr[ip.rhs]);
+    m_vm.unificationScope->match(BYTECODE_OFFSET(), cfr[ip.lhs], cfr[ip.rhs]);
     DISPATCH();
 }
 
 OP(ResolveType)
 {
-    Type* type = m_cfr[ip.type].asType();
-    // This might call a nested interpreter, which might resize the underlying stack storage
-    m_cfr[ip.dst] = preserveStack([&] {
-        return m_vm.unificationScope->resolve(type);
-    });
+    Type* type = cfr[ip.type].asType();
+    cfr[ip.dst] = m_vm.unificationScope->resolve(type);
     DISPATCH();
 }
 
 OP(CheckType)
 {
-    Value value = m_cfr[ip.type];
+    Value value = cfr[ip.type];
     bool result;
     static_assert(static_cast<uint8_t>(Type::Class::AnyValue) == 0);
     static_assert(static_cast<uint8_t>(Type::Class::AnyType) == 1);
@@ -430,40 +680,36 @@ OP(CheckType)
         result = static_cast<bool>(ip.expected) == value.isType();
     else
         result = value.isType() && ip.expected == value.asType()->typeClass();
-    m_cfr[ip.dst] = result;
+    cfr[ip.dst] = result;
     DISPATCH();
 }
 
 OP(CheckTypeOf)
 {
-    Value value = m_cfr[ip.type];
+    Value value = cfr[ip.type];
     Type* type = value.type(m_vm);
     ASSERT(ip.expected >= Type::Class::SpecificType, "OOPS");
-    m_cfr[ip.dst] = type->typeClass() == ip.expected;
+    cfr[ip.dst] = type->typeClass() == ip.expected;
     DISPATCH();
 }
 
 OP(TypeError)
 {
-    const std::string& message = m_block.identifier(ip.messageIndex);
-    m_vm.typeError(m_ip.offset(), message);
+    const std::string& message = m_block->identifier(ip.messageIndex);
+    m_vm.typeError(BYTECODE_OFFSET(), message);
     DISPATCH();
 }
 
 OP(InferImplicitParameters)
 {
-    TypeFunction* function = m_cfr[ip.function].asCell<Type>()->as<TypeFunction>();
+    TypeFunction* function = cfr[ip.function].asCell<Type>()->as<TypeFunction>();
     uint32_t firstParameterOffset = -ip.firstParameter.offset();
     for (uint32_t i = 0; i < ip.parameterCount; i++) {
         Type* type = function->implicitParam(i);
         ASSERT(type->is<TypeBinding>(), "OOPS");
         type = type->as<TypeBinding>()->type();
         ASSERT(type->is<TypeVar>(), "OOPS");
-        // This might call a nested interpreter, which might resize the underlying stack storage
-        Value result = preserveStack([&] {
-            return m_vm.unificationScope->infer(m_ip.offset(), type->as<TypeVar>());
-        });
-        m_cfr[Register::forLocal(firstParameterOffset + i)] = result;
+        cfr[Register::forLocal(firstParameterOffset + i)] = m_vm.unificationScope->infer(BYTECODE_OFFSET(), type->as<TypeVar>());
     }
     DISPATCH();
 }
@@ -472,107 +718,111 @@ OP(InferImplicitParameters)
 
 OP(NewVarType)
 {
-    const std::string& name = m_block.identifier(ip.nameIndex);
-    Type* bounds = m_cfr[ip.bounds].asCell<Type>();
+    const std::string& name = m_block->identifier(ip.nameIndex);
+    Type* bounds = cfr[ip.bounds].asCell<Type>();
     TypeVar* var = TypeVar::create(m_vm, name, ip.isInferred, ip.isRigid, bounds);
-    m_cfr[ip.dst] = var;
+    cfr[ip.dst] = var;
     DISPATCH();
 }
 
 OP(NewNameType)
 {
-    const std::string& name = m_block.identifier(ip.nameIndex);
-    m_cfr[ip.dst] = TypeName::create(m_vm, name);
+    const std::string& name = m_block->identifier(ip.nameIndex);
+    cfr[ip.dst] = TypeName::create(m_vm, name);
     DISPATCH();
 }
 
 OP(NewArrayType)
 {
-    Value itemType = m_cfr[ip.itemType];
-    m_cfr[ip.dst] = TypeArray::create(m_vm, itemType.asType());
+    Value itemType = cfr[ip.itemType];
+    cfr[ip.dst] = TypeArray::create(m_vm, itemType.asType());
     DISPATCH();
 }
 
 OP(NewTupleType)
 {
-    m_cfr[ip.dst] = TypeTuple::create(m_vm, ip.itemCount);
+    cfr[ip.dst] = TypeTuple::create(m_vm, ip.itemCount);
     DISPATCH();
 }
 
 OP(NewRecordType)
 {
-    Value* keys = &m_cfr[Register::forLocal(-ip.firstKey.offset() + ip.fieldCount - 1)];
-    Value* types = &m_cfr[Register::forLocal(-ip.firstType.offset() + ip.fieldCount - 1)];
-    m_cfr[ip.dst] = TypeRecord::create(m_vm, m_block, ip.fieldCount, keys, types);
+    Value* keys = &cfr[Register::forLocal(-ip.firstKey.offset() + ip.fieldCount - 1)];
+    Value* types = &cfr[Register::forLocal(-ip.firstType.offset() + ip.fieldCount - 1)];
+    cfr[ip.dst] = TypeRecord::create(m_vm, *m_block, ip.fieldCount, keys, types);
     DISPATCH();
 }
 
 OP(NewFunctionType)
 {
-    Value* params = &m_cfr[Register::forLocal(-ip.firstParam.offset() + ip.paramCount - 1)];
-    Value returnType = m_cfr[ip.returnType];
-    m_cfr[ip.dst] = TypeFunction::create(m_vm, ip.paramCount, params, returnType.asType(), ip.inferredParameters);
+    Value* params = &cfr[Register::forLocal(-ip.firstParam.offset() + ip.paramCount - 1)];
+    Value returnType = cfr[ip.returnType];
+    cfr[ip.dst] = TypeFunction::create(m_vm, ip.paramCount, params, returnType.asType(), ip.inferredParameters);
     DISPATCH();
 }
 
 OP(NewUnionType)
 {
-    auto* unionType = TypeUnion::create(m_vm, m_cfr[ip.lhs].asType(), m_cfr[ip.rhs].asType());
-    m_cfr[ip.dst] = unionType;
+    auto* unionType = TypeUnion::create(m_vm, cfr[ip.lhs].asType(), cfr[ip.rhs].asType());
+    cfr[ip.dst] = unionType;
     DISPATCH();
 }
 
 OP(NewBindingType)
 {
-    const std::string& name = m_block.identifier(ip.nameIndex);
-    auto* bindingTyp = TypeBinding::create(m_vm, String::create(m_vm, name), m_cfr[ip.type].asType());
-    m_cfr[ip.dst] = bindingTyp;
+    const std::string& name = m_block->identifier(ip.nameIndex);
+    auto* bindingTyp = TypeBinding::create(m_vm, String::create(m_vm, name), cfr[ip.type].asType());
+    cfr[ip.dst] = bindingTyp;
     DISPATCH();
 }
 
 OP(NewCallHole)
 {
-    Value callee = m_cfr[ip.callee];
-    Values args(ip.argc);
-    uint32_t firstArgOffset = -ip.firstArg.offset();
-    for (uint32_t i = 0; i < ip.argc; i++)
-        args[i] = m_cfr[Register::forLocal(firstArgOffset + i)];
-    m_cfr[ip.dst] = HoleCall::create(m_vm, callee, Array::create(m_vm, nullptr, std::move(args)));
+    Value callee = cfr[ip.callee];
+    {
+        Values args(&cfr[ip.firstArg], &cfr[ip.firstArg] + ip.argc);
+        cfr[ip.dst] = HoleCall::create(m_vm, callee, Array::create(m_vm, nullptr, std::move(args)));
+    }
     DISPATCH();
 }
 
 OP(NewSubscriptHole)
 {
-    Value target = m_cfr[ip.target];
-    Value index = m_cfr[ip.index];
-    m_cfr[ip.dst] = HoleSubscript::create(m_vm, target, index);
+    Value target = cfr[ip.target];
+    Value index = cfr[ip.index];
+    cfr[ip.dst] = HoleSubscript::create(m_vm, target, index);
     DISPATCH();
 }
 
 OP(NewMemberHole)
 {
-    Value object = m_cfr[ip.object];
-    const std::string& field = m_block.identifier(ip.fieldIndex);
-    m_cfr[ip.dst] = HoleMember::create(m_vm, object, String::create(m_vm, field));
+    Value object = cfr[ip.object];
+    const std::string& field = m_block->identifier(ip.fieldIndex);
+    cfr[ip.dst] = HoleMember::create(m_vm, object, String::create(m_vm, field));
     DISPATCH();
 }
 
 // New values from existing types
 OP(NewValue)
 {
-    Value value = m_cfr[ip.type];
+    Value value = cfr[ip.type];
     ASSERT(value.isType(), "OOPS");
-    m_cfr[ip.dst] = AbstractValue { value.asType() };
+    cfr[ip.dst] = AbstractValue { value.asType() };
     DISPATCH();
 }
 
 OP(GetTypeForValue)
 {
-    Value value = m_cfr[ip.value];
-    m_cfr[ip.dst] = value.type(m_vm)->instantiate(m_vm);
+    Value value = cfr[ip.value];
+    cfr[ip.dst] = value.type(m_vm)->instantiate(m_vm);
     DISPATCH();
 }
 
+}
+
 #undef JUMP
 #undef DISPATCH
+#undef NEXT
+#undef TRACE
+#undef BYTECODE_OFFSET
 #undef OP
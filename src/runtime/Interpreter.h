@@ -17,34 +17,25 @@ class Interpreter {
 
 public:
     static Value check(VM& vm, BytecodeBlock&, Environment*);
-    static Value run(VM& vm, BytecodeBlock&, Environment* = nullptr, const Values& = {}, const Callback& = {});
+    static Value run(VM& vm, BytecodeBlock&, Environment* = nullptr, const Value* args = nullptr, uint32_t argc = 0, const Callback& = {});
 
     void visit(const Visitor&) const;
 
     Environment* environment() const { return m_environment; }
 
 private:
-    enum class Mode {
-        Check = 0b01,
-        Run = 0b10,
-        CheckAndRun = 0b11,
-    };
+    using Mode = BytecodeBlock::Code;
 
-    Interpreter(VM&, BytecodeBlock&, InstructionStream::Offset, Environment*);
+    Interpreter(VM&, BytecodeBlock&, Mode, Environment*);
     ~Interpreter();
 
     VM& vm() { return m_vm; }
 
-    Value run(const Values& = {}, const Callback& = {});
-
-    template<typename Functor>
-    Value preserveStack(const Functor&);
-
-    void dispatch();
+    Value run(const Value* args = nullptr, uint32_t argc = 0, const Callback& = {});
+    Value* pushRegisters(size_t, InstructionStream::Offset);
+    void stackOverflowInCallee(InstructionStream::Offset);
 
-#define DECLARE_OP(Instruction) void run##Instruction(const Instruction&);
-    FOR_EACH_INSTRUCTION(DECLARE_OP)
-#undef DECLARE_OP
+    void execute(uint32_t argc);
 
     struct Stack {
         Value& operator[](const Register&) const;
@@ -52,15 +43,26 @@ private:
         Value* m_stackAddress;
     };
 
+    // What a Call saves before the callee starts running in the same loop,
+    // restored by the callee's End
+    struct CallFrame {
+        const Instruction* pc;
+        BytecodeBlock* block;
+        Environment* environment;
+        Stack cfr;
+        Mode mode;
+        uint32_t argc;
+    };
+
     VM& m_vm;
-    BytecodeBlock& m_block;
+    BytecodeBlock* m_block;
     const BytecodeBlock* m_lastBlock;
+    bool m_wasCheckingLastBlock;
     Environment* m_environment;
     Interpreter* m_lastInterpreter;
-    Mode m_mode { Mode::Run };
-    bool m_stop;
+    Mode m_mode;
     InstructionStream::Ref m_ip;
-    Stack m_cfr;
     Value m_result;
     Callback m_callback;
+    std::vector<CallFrame> m_callFrames;
 };
@@ -0,0 +1,113 @@
+#pragma once
+
+#include <atomic>
+#include <memory>
+#include <stdint.h>
+#include <vector>
+
+class Cell;
+
+// The cells a marking thread still has to visit, as a Chase-Lev work-stealing
+// deque. Only the owner pushes and pops, at the bottom, without taking a lock.
+// Marking threads that ran out of work steal from the top with a
+// compare-and-swap, which only races with the owner for the last cell.
+class MarkStack {
+public:
+    MarkStack()
+    {
+        m_arrays.emplace_back(std::make_unique<Array>(initialCapacity));
+        m_array.store(m_arrays.back().get(), std::memory_order_relaxed);
+    }
+
+    void push(Cell* cell)
+    {
+        int64_t bottom = m_bottom.load(std::memory_order_relaxed);
+        int64_t top = m_top.load(std::memory_order_acquire);
+        Array* array = m_array.load(std::memory_order_relaxed);
+        if (bottom - top > array->mask)
+            array = grow(array, top, bottom);
+        array->at(bottom).store(cell, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        m_bottom.store(bottom + 1, std::memory_order_relaxed);
+    }
+
+    Cell* pop()
+    {
+        int64_t bottom = m_bottom.load(std::memory_order_relaxed) - 1;
+        Array* array = m_array.load(std::memory_order_relaxed);
+        m_bottom.store(bottom, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        int64_t top = m_top.load(std::memory_order_relaxed);
+        if (top > bottom) {
+            m_bottom.store(bottom + 1, std::memory_order_relaxed);
+            return nullptr;
+        }
+
+        Cell* cell = array->at(bottom).load(std::memory_order_relaxed);
+        if (top == bottom) {
+            // The last cell goes to whoever moves the top past it first
+            if (!m_top.compare_exchange_strong(top, top + 1, std::memory_order_seq_cst, std::memory_order_relaxed))
+                cell = nullptr;
+            m_bottom.store(bottom + 1, std::memory_order_relaxed);
+        }
+        return cell;
+    }
+
+    // Returns nullptr when the stack is empty, but also when another thread
+    // took the cell first, in which case there might be more to steal.
+    Cell* steal()
+    {
+        int64_t top = m_top.load(std::memory_order_acquire);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        int64_t bottom = m_bottom.load(std::memory_order_acquire);
+        if (top >= bottom)
+            return nullptr;
+
+        Cell* cell = m_array.load(std::memory_order_acquire)->at(top).load(std::memory_order_relaxed);
+        if (!m_top.compare_exchange_strong(top, top + 1, std::memory_order_seq_cst, std::memory_order_relaxed))
+            return nullptr;
+        return cell;
+    }
+
+    bool isEmpty() const
+    {
+        int64_t top = m_top.load(std::memory_order_acquire);
+        int64_t bottom = m_bottom.load(std::memory_order_acquire);
+        return top >= bottom;
+    }
+
+private:
+    static constexpr int64_t initialCapacity = 256;
+
+    // A circular buffer indexed by the top and bottom, which only ever grow
+    struct Array {
+        Array(int64_t capacity)
+            : mask(capacity - 1)
+            , cells(new std::atomic<Cell*>[capacity])
+        {
+        }
+
+        std::atomic<Cell*>& at(int64_t index) { return cells[index & mask]; }
+
+        int64_t mask;
+        std::unique_ptr<std::atomic<Cell*>[]> cells;
+    };
+
+    // Thieves might still be reading from the old array, so it's kept until
+    // the stack is destroyed. Doubling the capacity keeps them few.
+    Array* grow(Array* array, int64_t top, int64_t bottom)
+    {
+        m_arrays.emplace_back(std::make_unique<Array>(2 * (array->mask + 1)));
+        Array* newArray = m_arrays.back().get();
+        for (int64_t i = top; i < bottom; ++i)
+            newArray->at(i).store(array->at(i).load(std::memory_order_relaxed), std::memory_order_relaxed);
+        m_array.store(newArray, std::memory_order_release);
+        return newArray;
+    }
+
+    alignas(64) std::atomic<int64_t> m_top { 0 };
+    alignas(64) std::atomic<int64_t> m_bottom { 0 };
+    std::atomic<Array*> m_array;
+    // Only touched by the owner
+    std::vector<std::unique_ptr<Array>> m_arrays;
+};
@@ -0,0 +1,30 @@
+#pragma once
+
+#include "Value.h"
+#include <cmath>
+
+// The operators on numbers built into the VM: macro(Instruction, name, result
+// type, expression). Each one is bound to a native function in the global
+// environment, and calls to it compile to the instruction of the same name,
+// which computes `expression` inline as long as the name still refers to the
+// VM's function when it runs. Programs can still define their own.
+#define FOR_EACH_NUMERIC_OPERATOR(macro) \
+    macro(Add, "+", number, lhs + rhs) \
+    macro(Sub, "-", number, lhs - rhs) \
+    macro(Mul, "*", number, lhs * rhs) \
+    macro(Div, "/", number, lhs / rhs) \
+    macro(Mod, "%", number, std::fmod(lhs, rhs)) \
+    macro(Less, "<", bool, lhs < rhs) \
+    macro(LessEqual, "<=", bool, lhs <= rhs) \
+    macro(Greater, ">", bool, lhs > rhs) \
+    macro(GreaterEqual, ">=", bool, lhs >= rhs) \
+    macro(Equal, "==", bool, lhs == rhs) \
+    macro(NotEqual, "!=", bool, lhs != rhs) \
+
+#define DEFINE_NUMERIC_OPERATOR(Instruction, name, resultType, expression) \
+    inline Value numeric##Instruction(double lhs, double rhs) \
+    { \
+        return expression; \
+    }
+FOR_EACH_NUMERIC_OPERATOR(DEFINE_NUMERIC_OPERATOR)
+#undef DEFINE_NUMERIC_OPERATOR
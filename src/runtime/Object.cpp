@@ -1,28 +1,105 @@
 #include "Object.h"
 
 #include "BytecodeBlock.h"
+#include <algorithm>
 
-Object::Object(Type* type, const BytecodeBlock& block, uint32_t fieldCount, const Value* keys, const Value* values)
+Object::Object(Type* type, uint32_t inlineSize)
     : Typed(type)
+    , m_shape(&vm().emptyShape)
+    , m_capacity(inlineSize)
+{
+    if (inlineSize)
+        m_slots = static_cast<Value*>(vm().heap.allocateStorage(inlineSize * sizeof(Value)));
+}
+
+Object::Object(Type* type, const BytecodeBlock& block, uint32_t fieldCount, const Value* keys, const Value* values)
+    : Object(type, fieldCount)
 {
     for (uint32_t i = 0; i < fieldCount; i++) {
         const std::string& key = block.identifier(keys[i].asNumber());
-        m_fields.emplace(key, values[i]);
+        set(key, values[i]);
+    }
+}
+
+Object::~Object()
+{
+    if (m_slots)
+        vm().heap.freeStorage(m_slots, m_capacity * sizeof(Value));
+    if (m_shape->isDictionary())
+        delete m_shape;
+}
+
+void Object::set(const std::string& field, Value value, FieldCache* cache)
+{
+    Heap::WriteBarrier barrier(this);
+    if (cache && cache->shape == m_shape) {
+        if (cache->transition) {
+            if (cache->slot >= m_capacity)
+                grow();
+            m_shape = cache->transition;
+        }
+        m_slots[cache->slot] = value;
+        return;
+    }
+
+    if (auto slot = m_shape->slot(field)) {
+        if (cache && !m_shape->isDictionary())
+            *cache = FieldCache { m_shape, nullptr, *slot };
+        m_slots[*slot] = value;
+        return;
     }
+
+    Shape* shape = m_shape;
+    if (!shape->isDictionary() && shape->size() == Shape::maxSize)
+        shape = shape->createDictionary().release();
+    Shape* newShape = shape->addField(field);
+    uint32_t slot = newShape->size() - 1;
+    if (slot >= m_capacity)
+        grow();
+    if (cache && !newShape->isDictionary())
+        *cache = FieldCache { m_shape, newShape, slot };
+    m_shape = newShape;
+    m_slots[slot] = value;
+}
+
+std::optional<Value> Object::tryGet(const std::string& field, FieldCache* cache) const
+{
+    if (cache && cache->shape == m_shape)
+        return { m_slots[cache->slot] };
+
+    auto slot = m_shape->slot(field);
+    if (!slot)
+        return std::nullopt;
+    if (cache && !m_shape->isDictionary())
+        *cache = FieldCache { m_shape, nullptr, *slot };
+    return { m_slots[*slot] };
+}
+
+// Only called while the cell is being changed, with the fields of its current shape
+void Object::grow()
+{
+    uint32_t capacity = std::max<uint32_t>(4, 2 * m_capacity);
+    auto* slots = static_cast<Value*>(vm().heap.allocateStorage(capacity * sizeof(Value)));
+    std::copy(m_slots, m_slots + m_shape->size(), slots);
+    if (m_slots)
+        vm().heap.freeStorage(m_slots, m_capacity * sizeof(Value));
+    m_slots = slots;
+    m_capacity = capacity;
 }
 
 void Object::visit(const Visitor& visitor) const
 {
     Typed::visit(visitor);
-    for (auto field : m_fields)
-        visitor.visit(field.second);
+    visitor.reportStorage(m_capacity * sizeof(Value));
+    for (uint32_t slot = 0; slot < m_shape->size(); slot++)
+        visitor.visit(m_slots[slot]);
 }
 
 void Object::dump(std::ostream& out) const
 {
     out << "{";
     bool first = true;
-    for (const auto& field : m_fields) {
+    for (const auto& field : *this) {
         if (!first)
             out << ", ";
         out << field.first << " = " << field.second;
@@ -36,7 +113,7 @@ Object* createObject(VM& vm, Type* type, uint32_t inlineSize)
     return Object::create(vm, type, inlineSize);
 }
 
-int64_t tryGetJIT(Object* object, const std::string& field)
+int64_t tryGetJIT(Object* object, const std::string& field, FieldCache* cache)
 {
-    return object->tryGet(field).value_or(Value::crash()).bits();
+    return object->tryGet(field, cache).value_or(Value::crash()).bits();
 }
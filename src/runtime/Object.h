@@ -1,5 +1,6 @@
 #pragma once
 
+#include "Shape.h"
 #include "Typed.h"
 #include "VM.h"
 #include <optional>
@@ -43,34 +44,51 @@
     FIELD_VALUE_SETTER(__type, __name) \
 
 class Object : public Typed {
+    friend class JIT;
+
 public:
     CELL(Object)
 
-    void set(const std::string& field, Value value)
-    {
-        m_fields[field] = value;
-    }
+    ~Object();
 
-    Value get(const std::string& field) const
-    {
-        auto it = m_fields.find(field);
-        ASSERT(it != m_fields.end(), "Unknown field: %s", field.c_str());
-        return it->second;
-    }
+    // `cache` lets the instructions that access a field skip looking it up
+    // while they keep seeing objects of the same shape.
+    void set(const std::string& field, Value, FieldCache* cache = nullptr);
 
-    std::optional<Value> tryGet(const std::string& field) const
+    Value get(const std::string& field, FieldCache* cache = nullptr) const
     {
-        auto it = m_fields.find(field);
-        if (it == m_fields.end())
-            return std::nullopt;
-        return { it->second };
+        if (cache && cache->shape == m_shape)
+            return m_slots[cache->slot];
+        auto value = tryGet(field, cache);
+        ASSERT(value, "Unknown field: %s", field.c_str());
+        return *value;
     }
 
-    size_t size() const { return m_fields.size(); }
-    std::unordered_map<std::string, Value>::iterator begin() { return m_fields.begin(); }
-    std::unordered_map<std::string, Value>::iterator end() { return m_fields.end(); }
-    std::unordered_map<std::string, Value>::const_iterator begin() const { return m_fields.begin(); }
-    std::unordered_map<std::string, Value>::const_iterator end() const { return m_fields.end(); }
+    std::optional<Value> tryGet(const std::string& field, FieldCache* cache = nullptr) const;
+
+    // Iterates over the fields in the order they were added
+    class iterator {
+        friend Object;
+
+    public:
+        bool operator!=(const iterator& other) const { return m_slot != other.m_slot; }
+        iterator& operator++() { ++m_slot; return *this; }
+        std::pair<const std::string&, Value> operator*() const { return { m_object->m_shape->field(m_slot), m_object->m_slots[m_slot] }; }
+
+    private:
+        iterator(const Object* object, uint32_t slot)
+            : m_object(object)
+            , m_slot(slot)
+        {
+        }
+
+        const Object* m_object;
+        uint32_t m_slot;
+    };
+
+    size_t size() const { return m_shape->size(); }
+    iterator begin() const { return iterator { this, 0 }; }
+    iterator end() const { return iterator { this, m_shape->size() }; }
 
     bool operator==(const Object&) const;
     Object* substitute(VM&, const Substitutions&) const;
@@ -78,17 +96,15 @@ public:
     void dump(std::ostream& out) const override;
 
 protected:
-    Object(Type* type, uint32_t inlineSize)
-        : Typed(type)
-    {
-        (void)inlineSize; // TODO
-    }
+    // Space for `inlineSize` fields is allocated upfront
+    Object(Type*, uint32_t inlineSize);
 
     template<typename T>
     Object(Type* type, const std::unordered_map<std::string, T>& fields)
-        : Typed(type)
-        , m_fields(fields.begin(), fields.end())
+        : Object(type, fields.size())
     {
+        for (const auto& field : fields)
+            set(field.first, field.second);
     }
 
     Object(Type*, const BytecodeBlock&, uint32_t, const Value*, const Value*);
@@ -96,11 +112,16 @@ protected:
     void visit(const Visitor&) const override;
 
 private:
-    std::unordered_map<std::string, Value> m_fields;
+    void grow();
+
+    // Owned by the object if it's a dictionary
+    Shape* m_shape;
+    Value* m_slots { nullptr };
+    uint32_t m_capacity;
 };
 
 // JIT helpers
 extern "C" {
 Object* createObject(VM&, Type*, uint32_t);
-int64_t tryGetJIT(Object*, const std::string&);
+int64_t tryGetJIT(Object*, const std::string&, FieldCache*);
 }
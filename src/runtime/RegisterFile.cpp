@@ -0,0 +1,16 @@
+#include "RegisterFile.h"
+
+#include <stdlib.h>
+
+RegisterFile::RegisterFile()
+{
+    m_limit = static_cast<Value*>(malloc(s_capacity * sizeof(Value)));
+    ASSERT(m_limit, "Failed to allocate the register file");
+    m_end = m_limit + s_capacity;
+    m_top = m_end;
+}
+
+RegisterFile::~RegisterFile()
+{
+    free(m_limit);
+}
@@ -0,0 +1,39 @@
+#pragma once
+
+#include "Assert.h"
+#include "Value.h"
+
+// The interpreter's registers: a fixed block of memory that grows downward, so
+// pushing and popping a frame only moves the top.
+class RegisterFile {
+public:
+    RegisterFile();
+    RegisterFile(const RegisterFile&) = delete;
+    ~RegisterFile();
+
+    // Returns the new top, or nullptr if there's no room for `count` more registers
+    Value* push(size_t count)
+    {
+        if (count > static_cast<size_t>(m_top - m_limit))
+            return nullptr;
+        m_top -= count;
+        return m_top;
+    }
+
+    void pop(size_t count)
+    {
+        m_top += count;
+        ASSERT(m_top <= m_end, "Register file underflow");
+    }
+
+    // The live registers, from the top of the stack to its bottom
+    Value* begin() const { return m_top; }
+    Value* end() const { return m_end; }
+
+private:
+    static constexpr size_t s_capacity = 1 << 20;
+
+    Value* m_limit;
+    Value* m_end;
+    Value* m_top;
+};
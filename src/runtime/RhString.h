@@ -8,7 +8,7 @@ public:
     CELL_TYPE(String)
     CELL_CREATE_VM(String)
 
-    const std::string& str() const { return m_str; }
+    std::string str() const { return std::string(m_str.data(), m_str.size()); }
 
     void dump(std::ostream& out) const override
     {
@@ -20,12 +20,19 @@ public:
         return m_str == other.m_str;
     }
 
+protected:
+    void visit(const Visitor& visitor) const override
+    {
+        Typed::visit(visitor);
+        visitor.reportStorage(m_str.capacity());
+    }
+
 private:
     String(VM& vm, const std::string& str)
         : Typed(vm.stringType)
-        , m_str(str)
+        , m_str(str.data(), str.size(), vm.heap)
     {
     }
 
-    std::string m_str;
+    std::basic_string<char, std::char_traits<char>, StorageAllocator<char>> m_str;
 };
@@ -0,0 +1,47 @@
+#include "Shape.h"
+
+#include "Assert.h"
+#include <algorithm>
+
+std::optional<uint32_t> Shape::slot(const std::string& field) const
+{
+    if (m_isDictionary) {
+        auto it = m_slots.find(field);
+        if (it == m_slots.end())
+            return std::nullopt;
+        return it->second;
+    }
+
+    auto it = std::find(m_fields.begin(), m_fields.end(), field);
+    if (it == m_fields.end())
+        return std::nullopt;
+    return it - m_fields.begin();
+}
+
+Shape* Shape::addField(const std::string& field)
+{
+    ASSERT(!slot(field), "Field is already in the shape: %s", field.c_str());
+    if (m_isDictionary) {
+        m_slots.emplace(field, m_fields.size());
+        m_fields.push_back(field);
+        return this;
+    }
+
+    std::unique_ptr<Shape>& transition = m_transitions[field];
+    if (!transition) {
+        transition = std::make_unique<Shape>();
+        transition->m_fields = m_fields;
+        transition->m_fields.push_back(field);
+    }
+    return transition.get();
+}
+
+std::unique_ptr<Shape> Shape::createDictionary() const
+{
+    auto dictionary = std::make_unique<Shape>();
+    dictionary->m_fields = m_fields;
+    for (uint32_t slot = 0; slot < m_fields.size(); slot++)
+        dictionary->m_slots.emplace(m_fields[slot], slot);
+    dictionary->m_isDictionary = true;
+    return dictionary;
+}
@@ -0,0 +1,52 @@
+#pragma once
+
+#include <memory>
+#include <optional>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// The fields of an object, in the order it got them. Objects that got the same
+// fields in the same order share a shape and keep each field in the slot at its
+// index: adding a field moves an object to the next shape of the tree, which is
+// created the first time an object takes that transition. Shapes belong to the
+// VM, which never frees them, except for dictionaries.
+//
+// Objects with more than `maxSize` fields get a dictionary instead: a shape of
+// their own that they add fields to in place, and that never shows up in a
+// FieldCache.
+class Shape {
+public:
+    static constexpr uint32_t maxSize = 64;
+
+    // The shape of objects without fields
+    Shape() = default;
+
+    uint32_t size() const { return m_fields.size(); }
+    const std::string& field(uint32_t slot) const { return m_fields[slot]; }
+    bool isDictionary() const { return m_isDictionary; }
+
+    std::optional<uint32_t> slot(const std::string&) const;
+
+    // The shape of an object of this shape once it gets `field`, which must
+    // not be in it yet. Dictionaries return themselves.
+    Shape* addField(const std::string& field);
+
+    std::unique_ptr<Shape> createDictionary() const;
+
+private:
+    std::vector<std::string> m_fields;
+    std::unordered_map<std::string, std::unique_ptr<Shape>> m_transitions;
+    // Only dictionaries index their fields, the others are small enough to search
+    std::unordered_map<std::string, uint32_t> m_slots;
+    bool m_isDictionary { false };
+};
+
+// What GetField, SetField and TryGetField found the last time they ran: the
+// slot of their field in objects of `shape`, and for a SetField that added the
+// field, the shape of the object afterwards.
+struct FieldCache {
+    Shape* shape { nullptr };
+    Shape* transition { nullptr };
+    uint64_t slot { 0 };
+};
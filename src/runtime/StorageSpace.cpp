@@ -0,0 +1,83 @@
+#include "StorageSpace.h"
+
+#include "Assert.h"
+#include <stdlib.h>
+
+StorageSpace::~StorageSpace()
+{
+    for (void* block : m_blocks)
+        ::free(block);
+    for (void* allocation : m_largeAllocations)
+        ::free(allocation);
+}
+
+void* StorageSpace::allocate(size_t size)
+{
+    if (size > s_maxSmallSize)
+        return allocateLarge(size);
+    return allocateSmall(size);
+}
+
+void StorageSpace::free(void* storage, size_t size)
+{
+    if (size > s_maxSmallSize) {
+        size_t erased = m_largeAllocations.erase(storage);
+        ASSERT(erased, "Freeing unknown large allocation");
+        ::free(storage);
+        m_size -= size;
+        return;
+    }
+
+    size_t index = sizeClassIndex(size);
+    FreeSlot* slot = static_cast<FreeSlot*>(storage);
+    slot->next = m_sizeClasses[index].freeList;
+    m_sizeClasses[index].freeList = slot;
+    m_size -= sizeClassSize(index);
+}
+
+size_t StorageSpace::sizeClassIndex(size_t size)
+{
+    if (size <= s_minSize)
+        return 0;
+    return 64 - __builtin_clzll(size - 1) - __builtin_ctzll(s_minSize);
+}
+
+size_t StorageSpace::sizeClassSize(size_t index)
+{
+    return s_minSize << index;
+}
+
+void* StorageSpace::allocateSmall(size_t size)
+{
+    size_t index = sizeClassIndex(size);
+    size_t slotSize = sizeClassSize(index);
+    SizeClass& sizeClass = m_sizeClasses[index];
+    m_size += slotSize;
+
+    if (FreeSlot* slot = sizeClass.freeList) {
+        sizeClass.freeList = slot->next;
+        return slot;
+    }
+
+    if (sizeClass.bump == sizeClass.end) {
+        void* block;
+        int result = posix_memalign(&block, s_blockSize, s_blockSize);
+        ASSERT(!result, "Failed to create storage block");
+        m_blocks.emplace_back(block);
+        sizeClass.bump = static_cast<uint8_t*>(block);
+        sizeClass.end = sizeClass.bump + s_blockSize;
+    }
+
+    void* slot = sizeClass.bump;
+    sizeClass.bump += slotSize;
+    return slot;
+}
+
+void* StorageSpace::allocateLarge(size_t size)
+{
+    void* allocation = malloc(size);
+    ASSERT(allocation, "OOM: failed to allocate %lu bytes of storage", size);
+    m_largeAllocations.emplace(allocation);
+    m_size += size;
+    return allocation;
+}
@@ -0,0 +1,52 @@
+#pragma once
+
+#include <array>
+#include <unordered_set>
+#include <vector>
+
+// Out-of-line storage for the payloads of cells, such as the items of an Array.
+// Storage is owned by the cell it was allocated for and freed when that cell is
+// destroyed, but lives in memory owned by the heap so that it counts towards the
+// heap's size.
+class StorageSpace {
+public:
+    StorageSpace() = default;
+    StorageSpace(const StorageSpace&) = delete;
+    ~StorageSpace();
+
+    void* allocate(size_t);
+    void free(void*, size_t);
+
+    // Bytes currently allocated, including the rounding up to size classes
+    size_t size() const { return m_size; }
+
+private:
+    static constexpr size_t s_blockSize = 0x10000;
+    static constexpr size_t s_minSize = 16;
+    // Anything bigger than a quarter of a block goes into the large object space
+    static constexpr size_t s_maxSmallSize = s_blockSize / 4;
+    static constexpr size_t s_sizeClassCount = 11;
+
+    struct FreeSlot {
+        FreeSlot* next;
+    };
+
+    // Power-of-two size class: slots are carved out of the current block, and
+    // freed slots are reused before carving new ones.
+    struct SizeClass {
+        FreeSlot* freeList { nullptr };
+        uint8_t* bump { nullptr };
+        uint8_t* end { nullptr };
+    };
+
+    static size_t sizeClassIndex(size_t);
+    static size_t sizeClassSize(size_t);
+
+    void* allocateSmall(size_t);
+    void* allocateLarge(size_t);
+
+    size_t m_size { 0 };
+    std::array<SizeClass, s_sizeClassCount> m_sizeClasses;
+    std::vector<void*> m_blocks;
+    std::unordered_set<void*> m_largeAllocations;
+};
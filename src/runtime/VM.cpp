@@ -14,33 +14,43 @@ static void addFunction(VM* vm, const char* name, NativeFunction fn, Type* type)
     vm->globalEnvironment->set(name, Value { builtinFunction });
 }
 
-static Value functionPrint(VM&, std::vector<Value> args)
+static Value functionPrint(VM&, const Value* args, uint32_t argc)
 {
-    ASSERT(args.size() == 1, "print expects a single argument");
+    ASSERT(argc == 1, "print expects a single argument");
     ASSERT(args[0].isCell<String>(), "print expects a string as its first argument");
     std::cout << args[0].asCell<String>()->str();
     return Value::unit();
 }
 
-static Value functionPrintln(VM&, std::vector<Value> args)
+static Value functionPrintln(VM&, const Value* args, uint32_t argc)
 {
-    ASSERT(args.size() == 1, "println expects a single argument");
+    ASSERT(argc == 1, "println expects a single argument");
     ASSERT(args[0].isCell<String>(), "println expects a string as its first argument");
     std::cout << args[0].asCell<String>()->str() << std::endl;;
     return Value::unit();
 }
 
-static Value functionStringify(VM& vm, std::vector<Value> args)
+static Value functionStringify(VM& vm, const Value* args, uint32_t argc)
 {
-    ASSERT(args.size() == 1, "stringify expects a single argument");
+    ASSERT(argc == 1, "stringify expects a single argument");
     std::stringstream str;
     args[0].dump(str);
     return String::create(vm, str.str());
 }
 
-VM::VM()
+#define DEFINE_NUMERIC_OPERATOR_FUNCTION(Instruction, name, resultType, expression) \
+    static Value function##Instruction(VM&, const Value* args, uint32_t argc) \
+    { \
+        ASSERT(argc == 2, "%s expects two arguments", name); \
+        ASSERT(args[0].isNumber() && args[1].isNumber(), "%s expects numbers as its arguments", name); \
+        return numeric##Instruction(args[0].asNumber(), args[1].asNumber()); \
+    }
+FOR_EACH_NUMERIC_OPERATOR(DEFINE_NUMERIC_OPERATOR_FUNCTION)
+#undef DEFINE_NUMERIC_OPERATOR_FUNCTION
+
+VM::VM(const HeapOptions& heapOptions)
     : typeChecker(nullptr)
-    , heap(this)
+    , heap(this, heapOptions)
     , stringType(nullptr)
     , typeType(TypeType::create(*this))
     , topType(TypeTop::create(*this))
@@ -53,9 +63,6 @@ VM::VM()
     stringType = TypeName::create(*this, "String");
     globalEnvironment = Environment::create(*this, nullptr);
 
-    // so we don't crash when calling stack.back()
-    stack.push_back(Value::crash());
-
     Value stringValue = stringType;
     auto* printType = TypeFunction::create(*this, 1, &stringValue, unitType, 0);
     addFunction(this, "print", functionPrint, printType);
@@ -65,23 +72,75 @@ VM::VM()
     auto* stringifyType = TypeFunction::create(*this, 1, &topValue, stringType, 0);
     addFunction(this, "stringify", functionStringify, stringifyType);
 
+    Value numberValues[] = { numberType, numberType };
+#define ADD_NUMERIC_OPERATOR(Instruction, name, resultType, expression) \
+    builtin##Instruction = Function::create(*this, function##Instruction, TypeFunction::create(*this, 2, numberValues, resultType##Type, 0)); \
+    globalEnvironment->set(name, Value { builtin##Instruction });
+FOR_EACH_NUMERIC_OPERATOR(ADD_NUMERIC_OPERATOR)
+#undef ADD_NUMERIC_OPERATOR
+
     globalEnvironment->set("Void", unitType);
     globalEnvironment->set("Bool", boolType);
     globalEnvironment->set("Number", numberType);
     globalEnvironment->set("String", stringType);
 }
 
+std::optional<uint32_t> VM::globalCellIndex(const std::string& name) const
+{
+    auto it = m_globalCellIndices.find(name);
+    if (it == m_globalCellIndices.end())
+        return std::nullopt;
+    return it->second;
+}
+
+void VM::didBind(const Environment* environment, const std::string& name, Value value)
+{
+    auto it = m_globalCellIndices.find(name);
+    if (environment == globalEnvironment) {
+        if (it == m_globalCellIndices.end()) {
+            it = m_globalCellIndices.emplace(name, m_globalCells.size()).first;
+            m_globalCells.emplace_back();
+        }
+        GlobalCell& cell = m_globalCells[it->second];
+        if (!cell.hasFired)
+            cell.value = value;
+        return;
+    }
+
+    if (it == m_globalCellIndices.end())
+        return;
+    GlobalCell& cell = m_globalCells[it->second];
+    cell.value = Value::crash();
+    cell.hasFired = true;
+}
+
 void VM::typeError(InstructionStream::Offset bytecodeOffset, const std::string& message)
 {
-    m_typeErrors.emplace_back(TypeError { currentBlock->locationInfo(bytecodeOffset), message });
+    m_typeErrors.emplace_back(TypeError { locationInfo(bytecodeOffset), message });
 }
 
 void VM::runtimeError(InstructionStream::Offset bytecodeOffset, const std::string& message)
 {
-    std::cerr << currentBlock->locationInfo(bytecodeOffset) << ": " << message << std::endl;
+    std::cerr << locationInfo(bytecodeOffset) << ": " << message << std::endl;
+    exit(EXIT_FAILURE);
+}
+
+void VM::typeError(const BytecodeBlock& block, InstructionStream::Offset bytecodeOffset, const std::string& message)
+{
+    m_typeErrors.emplace_back(TypeError { block.locationInfo(bytecodeOffset), message });
+}
+
+void VM::runtimeError(const BytecodeBlock& block, InstructionStream::Offset bytecodeOffset, const std::string& message)
+{
+    std::cerr << block.locationInfo(bytecodeOffset) << ": " << message << std::endl;
     exit(EXIT_FAILURE);
 }
 
+LocationInfoWithFile VM::locationInfo(InstructionStream::Offset bytecodeOffset) const
+{
+    return currentBlock->locationInfo(bytecodeOffset, isCheckingCurrentBlock ? BytecodeBlock::Code::Check : BytecodeBlock::Code::Run);
+}
+
 bool VM::hasTypeErrors() const
 {
     return !m_typeErrors.empty();
@@ -108,6 +167,10 @@ void VM::visit(const Visitor& visitor) const
     visitor.visit(boolType);
     visitor.visit(numberType);
     visitor.visit(globalEnvironment);
+#define VISIT_NUMERIC_OPERATOR(Instruction, name, resultType, expression) \
+    visitor.visit(builtin##Instruction);
+FOR_EACH_NUMERIC_OPERATOR(VISIT_NUMERIC_OPERATOR)
+#undef VISIT_NUMERIC_OPERATOR
 
     if (currentInterpreter)
         currentInterpreter->visit(visitor);
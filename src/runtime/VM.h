@@ -3,11 +3,19 @@
 #include "Heap.h"
 #include "InstructionStream.h"
 #include "LocationInfo.h"
+#include "NumericOperators.h"
+#include "RegisterFile.h"
+#include "Shape.h"
 #include "Value.h"
+#include <deque>
+#include <optional>
+#include <unordered_map>
 #include <vector>
 
 class BytecodeBlock;
 class Environment;
+class Function;
+class InstructionPairProfile;
 class Interpreter;
 class Scope;
 class Type;
@@ -15,25 +23,52 @@ class TypeChecker;
 class UnificationScope;
 class Value;
 
+// A binding of the global environment, which run code reads directly instead of
+// looking its name up, see GetGlobal. Once any other environment binds the same
+// name, a lookup could find that binding first, so the cell's watchpoint fires:
+// from then on it holds Value::crash() and its readers look the name up.
+struct GlobalCell {
+    Value value;
+    bool hasFired { false };
+};
+
 class VM {
 public:
-    VM();
+    VM(const HeapOptions& = {});
 
     void typeError(InstructionStream::Offset, const std::string&);
     void runtimeError(InstructionStream::Offset, const std::string&);
+    // For JIT code, which runs the code of `block` without making it the
+    // currentBlock
+    void typeError(const BytecodeBlock&, InstructionStream::Offset, const std::string&);
+    void runtimeError(const BytecodeBlock&, InstructionStream::Offset, const std::string&);
     bool hasTypeErrors() const;
     bool reportTypeErrors();
 
+    // Where an instruction of the code that is currently running came from
+    LocationInfoWithFile locationInfo(InstructionStream::Offset) const;
+
     void visit(const Visitor&) const;
 
-    Environment* globalEnvironment;
+    std::optional<uint32_t> globalCellIndex(const std::string&) const;
+    GlobalCell& globalCell(uint32_t index) { return m_globalCells[index]; }
+    // Called by Environment::set to keep the cells in sync
+    void didBind(const Environment*, const std::string&, Value);
+
+    Environment* globalEnvironment { nullptr };
     Interpreter* currentInterpreter { nullptr };
-    BytecodeBlock* globalBlock;
+    BytecodeBlock* globalBlock { nullptr };
     const BytecodeBlock* currentBlock;
+    // Whether currentBlock is running its type checking code
+    bool isCheckingCurrentBlock { false };
     TypeChecker* typeChecker { nullptr };
+    bool dumpBytecode { false };
+    InstructionPairProfile* instructionPairProfile { nullptr };
 
+    // The root of the tree of shapes, which must outlive every object
+    Shape emptyShape;
     Heap heap;
-    std::vector<Value> stack;
+    RegisterFile stack;
 
     // TypeChecking business
     Scope* typingScope { nullptr };
@@ -47,6 +82,11 @@ public:
     Type* boolType;
     Type* numberType;
 
+#define DECLARE_NUMERIC_OPERATOR(Instruction, name, resultType, expression) \
+    Function* builtin##Instruction { nullptr };
+FOR_EACH_NUMERIC_OPERATOR(DECLARE_NUMERIC_OPERATOR)
+#undef DECLARE_NUMERIC_OPERATOR
+
 private:
     struct TypeError {
         LocationInfoWithFile locationInfo;
@@ -54,4 +94,9 @@ private:
     };
 
     std::vector<TypeError> m_typeErrors;
+
+    // The global environment is only populated before any code runs, so every
+    // other binding of one of its names comes after the cell for it exists.
+    std::deque<GlobalCell> m_globalCells;
+    std::unordered_map<std::string, uint32_t> m_globalCellIndices;
 };
@@ -5,6 +5,8 @@
 #include "Function.h"
 #include "Type.h"
 #include "VM.h"
+#include <cmath>
+#include <limits>
 #include <string>
 
 #define CHECK() ASSERT(!isCrash(), "Value::crash")
@@ -41,6 +43,10 @@ Value::Value(int32_t i)
 
 Value::Value(double d)
 {
+    // The NaNs that x86 produces have their sign bit set, which would overflow
+    // into the tag bits once encoded
+    if (std::isnan(d))
+        d = std::numeric_limits<double>::quiet_NaN();
     union {
         double d;
         int64_t i;
@@ -14,6 +14,7 @@ void holeCodegen(Value, BytecodeGenerator&, Register);
 
 BytecodeBlock* holeCodegen(Value hole, BytecodeGenerator& generator)
 {
+    generator.skipTypeChecking();
     Register tmp = generator.newLocal();
     holeCodegen(hole, generator, tmp);
     return generator.finalize(tmp);
@@ -116,10 +117,8 @@ void HoleCall::generate(BytecodeGenerator& generator, Register dst) const
 {
     Register calleeReg = generator.newLocal();
     holeCodegen(callee(), generator, calleeReg);
-    std::vector<Register> args;
     Array* arguments = this->arguments();
-    for (size_t i = 0; i < arguments->size(); i++)
-        args.push_back(generator.newLocal());
+    std::vector<Register> args = generator.newArguments(arguments->size());
     for (size_t i = 0; i < arguments->size(); i++)
         holeCodegen(arguments->getIndex(i), generator, args[i]);
     generator.call(dst, calleeReg, args);
@@ -9,7 +9,7 @@
 
 // Helpers
 
-static Array* partiallyEvaluateArray(std::vector<Value>::iterator begin, std::vector<Value>::iterator end, VM& vm, Environment* env)
+static Array* partiallyEvaluateArray(Array::Items::iterator begin, Array::Items::iterator end, VM& vm, Environment* env)
 {
     Array* array_ = Array::create(vm, nullptr, end - begin);
     uint32_t i = 0;
@@ -147,7 +147,7 @@ TypeArray* TypeArray::partiallyEvaluate(VM& vm, Environment* env) const
 TypeRecord* TypeRecord::partiallyEvaluate(VM& vm, Environment* env) const
 {
     Object* fields = Object::create(vm, nullptr, 0);
-    for (auto& field : *this) {
+    for (const auto& field : *this) {
         fields->set(field.first, ::partiallyEvaluate(field.second, vm, env));
     }
     return TypeRecord::create(vm, fields);
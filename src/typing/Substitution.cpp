@@ -111,7 +111,7 @@ Type* TypeTuple::substitute(VM& vm, const Substitutions& subst) const
 Type* TypeRecord::substitute(VM& vm, const Substitutions& subst) const
 {
     Object* fields = Object::create(vm, nullptr, 0);
-    for (auto& field : *this) {
+    for (const auto& field : *this) {
         fields->set(field.first, field.second.substitute(vm, subst));
     }
     return TypeRecord::create(vm, fields);
@@ -2,6 +2,7 @@
 
 #include "BytecodeBlock.h"
 #include "TypeChecker.h"
+#include <algorithm>
 #include <typeinfo>
 
 Type::Type(Class typeClass)
@@ -114,14 +115,24 @@ Type* TypeFunction::implicitParam(uint32_t index) const
 
 Type* TypeFunction::instantiate(VM& vm)
 {
+    // The fresh variables are only referenced from `subst`, which the collector
+    // can't see, so they have to be kept alive explicitly until we are done.
     Substitutions subst;
+    std::vector<Type*> roots;
     for (Type* type : *params()) {
         if (type->is<TypeBinding>())
             type = type->as<TypeBinding>()->type();
-        if (type->is<TypeVar>())
-            type->as<TypeVar>()->fresh(vm, subst);
+        if (type->is<TypeVar>()) {
+            TypeVar* var = type->as<TypeVar>();
+            var->fresh(vm, subst);
+            roots.emplace_back(subst[var->uid()]);
+            vm.heap.addRoot(roots.back());
+        }
     }
-    return substitute(vm, subst);
+    Type* result = substitute(vm, subst);
+    for (Type* root : roots)
+        vm.heap.removeRoot(root);
+    return result;
 }
 
 void TypeFunction::dump(std::ostream& out) const
@@ -173,7 +184,8 @@ void TypeTuple::dump(std::ostream& out) const
 TypeRecord::TypeRecord(Object* fields)
     : Type(Type::Class::Record)
 {
-    *static_cast<Object*>(this) = *fields;
+    for (const auto& field : *fields)
+        set(field.first, field.second);
 }
 
 TypeRecord::TypeRecord(const BytecodeBlock& block, uint32_t fieldCount, const Value* keys, const Value* types)
@@ -193,11 +205,21 @@ Type* TypeRecord::field(const std::string& name) const
     return field->asCell<Type>();
 }
 
+// The order in which the fields of a record type were added depends on how the
+// type was computed, e.g. on substitutions and on the addresses of the
+// identifiers of a record literal, so print them sorted by name instead.
 void TypeRecord::dump(std::ostream& out) const
 {
+    std::vector<std::pair<std::string, Value>> fields;
+    for (const auto& pair : *this)
+        fields.emplace_back(pair.first, pair.second);
+    std::sort(fields.begin(), fields.end(), [](const auto& a, const auto& b) {
+        return a.first < b.first;
+    });
+
     out << "{";
     bool isFirst = true;
-    for (auto& pair : *this) {
+    for (const auto& pair : fields) {
         if (!isFirst)
             out << ", ";
         out << pair.first << ": " << pair.second;
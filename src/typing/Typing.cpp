@@ -48,16 +48,16 @@ void FunctionDeclaration::check(TypeChecker& tc, Register result)
 
     Register valueRegister = tc.generator().newLocal();
 
-    BytecodeGenerator functionGenerator { tc.generator().vm(), name->name };
-    Register resultRegister = functionGenerator.newLocal();
+    auto functionGenerator = std::make_unique<BytecodeGenerator>(tc.generator().vm(), name->name);
+    Register resultRegister = functionGenerator->newLocal();
     {
-        TypeChecker functionTC { functionGenerator };
-        Register typeRegister = functionGenerator.newLocal();
+        TypeChecker functionTC { *functionGenerator };
+        Register typeRegister = functionGenerator->newLocal();
 
         std::vector<Register> parameterRegisters;
-        Register returnRegister = functionGenerator.newLocal();
+        Register returnRegister = functionGenerator->newLocal();
         for (uint32_t i = 0; i < parameters.size(); i++)
-            parameterRegisters.emplace_back(functionGenerator.newLocal());
+            parameterRegisters.emplace_back(functionGenerator->newLocal());
 
         uint32_t inferredParameters = 0;
         ASSERT(parameters.size() < 32, "OOPS");
@@ -90,9 +90,7 @@ void FunctionDeclaration::check(TypeChecker& tc, Register result)
 
         functionTC.endTypeChecking(TypeChecker::Mode::Function, typeRegister);
     }
-    generateImpl(functionGenerator, resultRegister);
-    auto block = functionGenerator.finalize(resultRegister);
-    functionIndex = tc.generator().newFunction(valueRegister, std::move(block));
+    functionIndex = tc.generator().newFunction(valueRegister, std::move(functionGenerator));
     tc.insert(name->name, valueRegister);
 
     Register tmp = tc.generator().newLocal();
@@ -73,7 +73,7 @@ Type* UnificationScope::infer(InstructionStream::Offset bytecodeOffset, TypeVar*
     message << "Unification failure: failed to infer type variable `" << *var << "`";
     m_unificationFailed = true;
     if (m_shouldThrowTypeError) {
-        LOG(ConstraintSolving, message.str() << " @ " << m_vm.currentBlock->locationInfo(bytecodeOffset));
+        LOG(ConstraintSolving, message.str() << " @ " << m_vm.locationInfo(bytecodeOffset));
         m_vm.typeError(bytecodeOffset, message.str());
     }
     return m_vm.unitType;
@@ -120,7 +120,7 @@ void UnificationScope::unifies(InstructionStream::Offset bytecodeOffset, Value l
     if (lhsType == rhsType)
         return;
 
-    LOG(ConstraintSolving, "Solving constraint: " << *lhsType << " <: " << *rhsType << " @ " << m_vm.currentBlock->locationInfo(bytecodeOffset));
+    LOG(ConstraintSolving, "Solving constraint: " << *lhsType << " <: " << *rhsType << " @ " << m_vm.locationInfo(bytecodeOffset));
 
     // Γ ⊢ σ <: τ
     // ---------------------------------------- T-Binding-L
@@ -136,7 +136,7 @@ void UnificationScope::unifies(InstructionStream::Offset bytecodeOffset, Value l
     // Γ ⊢ σ <: x : τ
     if (rhsType->is<TypeBinding>()) {
         TypeBinding* binding = rhsType->as<TypeBinding>();
-        LOG(ConstraintSolving, "Setting variable `" << binding->name()->str() << "` to `" << lhs << "`" << " @ " << m_vm.currentBlock->locationInfo(bytecodeOffset));
+        LOG(ConstraintSolving, "Setting variable `" << binding->name()->str() << "` to `" << lhs << "`" << " @ " << m_vm.locationInfo(bytecodeOffset));
         m_environment->set(binding->name()->str(), lhs);
         unifies(bytecodeOffset, lhs, binding->type());
         return;
@@ -345,14 +345,14 @@ unificationError:
     msg << "Unification failure: expected `" << *rhsType << "` but found `" << *lhsType << "`";
     m_unificationFailed = true;
     if (m_shouldThrowTypeError) {
-        LOG(ConstraintSolving, msg.str() << " @ " << m_vm.currentBlock->locationInfo(bytecodeOffset));
+        LOG(ConstraintSolving, msg.str() << " @ " << m_vm.locationInfo(bytecodeOffset));
         m_vm.typeError(bytecodeOffset, msg.str());
     }
 }
 
 void UnificationScope::matches(InstructionStream::Offset bytecodeOffset, Value scrutinee, Value pattern)
 {
-    LOG(ConstraintSolving, "Solving constraint: " << scrutinee << " `matches` " << pattern << " @ " << m_vm.currentBlock->locationInfo(bytecodeOffset));
+    LOG(ConstraintSolving, "Solving constraint: " << scrutinee << " `matches` " << pattern << " @ " << m_vm.locationInfo(bytecodeOffset));
 
     Type* scrutineeType = scrutinee.type(m_vm)->substitute(m_vm, m_substitutions);
 
@@ -417,7 +417,7 @@ Type* UnificationScope::eval(Value hole)
 
 void UnificationScope::bind(InstructionStream::Offset bytecodeOffset, TypeVar* var, Type* type)
 {
-    LOG(ConstraintSolving, "Binding type `" << *var << "` to `" << *type << "`" << " @ " << m_vm.currentBlock->locationInfo(bytecodeOffset));
+    LOG(ConstraintSolving, "Binding type `" << *var << "` to `" << *type << "`" << " @ " << m_vm.locationInfo(bytecodeOffset));
     unifies(bytecodeOffset, type, var->bounds());
     m_substitutions.emplace(var->uid(), type);
 }